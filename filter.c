@@ -0,0 +1,53 @@
+#include "filter.h"
+
+#include <math.h>
+
+static double seconds_between(struct timeval const *from,
+                              struct timeval const *to) {
+  return (to->tv_sec - from->tv_sec) + (to->tv_usec - from->tv_usec) / 1e6;
+}
+
+/* smoothing factor of an exponential filter with the given cutoff */
+static double smoothing(double cutoff, double dt) {
+  double tau = 1.0 / (2.0 * M_PI * cutoff);
+  return 1.0 / (1.0 + tau / dt);
+}
+
+void one_euro_init(struct one_euro_filter *filter, double min_cutoff,
+                   double beta, double d_cutoff) {
+  filter->min_cutoff = min_cutoff;
+  filter->beta = beta;
+  filter->d_cutoff = d_cutoff;
+  filter->ready = false;
+}
+
+double one_euro_update(struct one_euro_filter *filter, double value,
+                       struct timeval const *ts) {
+  if (!filter->ready) {
+    filter->value = value;
+    filter->speed = 0;
+    filter->ts = *ts;
+    filter->ready = true;
+    return value;
+  }
+
+  double dt = seconds_between(&filter->ts, ts);
+  if (dt <= 0) {
+    // same sample time, nothing to learn the speed from
+    return filter->value;
+  }
+
+  double speed = (value - filter->value) / dt;
+  filter->speed += smoothing(filter->d_cutoff, dt) * (speed - filter->speed);
+
+  double cutoff = filter->min_cutoff + filter->beta * fabs(filter->speed);
+  filter->value += smoothing(cutoff, dt) * (value - filter->value);
+  filter->ts = *ts;
+  return filter->value;
+}
+
+double one_euro_predict(struct one_euro_filter const *filter,
+                        struct timeval const *at, double max_lead) {
+  double lead = fmax(0, fmin(max_lead, seconds_between(&filter->ts, at)));
+  return filter->value + filter->speed * lead;
+}
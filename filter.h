@@ -0,0 +1,31 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdbool.h>
+#include <sys/time.h>
+
+/* One Euro filter (Casiez et al., CHI 2012): a low-pass filter whose cutoff
+ * rises with the speed of the signal, smoothing jitter while it's slow and
+ * keeping lag low while it moves fast. */
+struct one_euro_filter {
+  double min_cutoff; /* Hz, cutoff while the signal is still */
+  double beta;       /* cutoff increase per unit/second of speed */
+  double d_cutoff;   /* Hz, cutoff of the speed estimate */
+
+  bool ready;
+  double value; /* filtered */
+  double speed; /* filtered, units per second */
+  struct timeval ts;
+};
+
+void one_euro_init(struct one_euro_filter *filter, double min_cutoff,
+                   double beta, double d_cutoff);
+/* Adds a sample taken at ts, returns the filtered value */
+double one_euro_update(struct one_euro_filter *filter, double value,
+                       struct timeval const *ts);
+/* Extrapolates the filtered value to time at at constant speed, looking no
+ * further ahead than max_lead seconds */
+double one_euro_predict(struct one_euro_filter const *filter,
+                        struct timeval const *at, double max_lead);
+
+#endif
@@ -1,9 +1,14 @@
 #include "input.h"
 
 #include "SDL/SDL.h"
+#include "filter.h"
 #include "input_latency.h"
+#include "interp.h"
 #include "motion.h"
 #include <math.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
 
 int ir_up, ir_down, ir_left, ir_right, steer_left, steer_right, nunchuk_up,
     nunchuk_down, nunchuk_left, nunchuk_right, classic_left_stick_up,
@@ -12,317 +17,798 @@ int ir_up, ir_down, ir_left, ir_right, steer_left, steer_right, nunchuk_up,
     motionplus_slow;
 extern int show_reports;
 
-static const double pointer_margin = 0.5;
 float pointer_x = 0.5;
 float pointer_y = 0.5;
 static const uint16_t accelerometer_zero = 0x85 << 2;
 static const uint16_t accelerometer_unit = 0x6C;
+// degrees/second of the digital MotionPlus actions, with and without slow
+static const float motionplus_slow_rate = 40.0;
+static const float motionplus_fast_rate = 1600.0 / 4.4;
 struct timeval pending_ir_ts = {0, 0};
 struct timeval pending_accel_ts = {0, 0};
 struct timeval pending_button_ts = {0, 0};
+struct timeval latest_input_ts = {0, 0};
+uint64_t input_coalesced_events = 0;
+bool input_raw_ir = false;
+
+// parts of the state last set directly by a state event rather than derived
+// from the pointer and the digital stick/motion flags
+static uint16_t external_fields = 0;
+
+// parts of the state a pose event sets, and whether they still follow the
+// pose model, until another event sets any of them
+#define POSE_STATE_FIELDS                                                      \
+  (INPUT_STATE_ACCEL | INPUT_STATE_IR | INPUT_STATE_MOTIONPLUS)
+static bool pose_input = false;
+
+// Optional One Euro filter between the pointer input and the motion model.
+// The filtered pointer is extrapolated to the time each report is built,
+// plus pointer_lead for the latency after it.
+static bool pointer_filter = false;
+static struct one_euro_filter pointer_filter_x, pointer_filter_y;
+static double pointer_lead = 0;
+static const double pointer_max_lead = 0.1;
+// a pointer sample arrived this tick, taken at pointer_sample_ts
+static bool pointer_sampled = false;
+static struct timeval pointer_sample_ts;
+
+// Optional interpolation of the analog channels producers send, between
+// their last two samples. interp_sampled holds the (1 << interp_channel)
+// bits of the channels an event set this tick, at interp_sample_ts.
+static bool interpolation = false;
+static unsigned interp_sampled = 0;
+static struct timeval interp_sample_ts[INTERP_CHANNELS];
+
+// where input_update and input_prepare_report take the time from, NULL for
+// gettimeofday
+static input_clock clock_source = NULL;
+uint64_t input_reports_sent = 0;
+uint64_t input_report_turns = 0;
+
+uint64_t input_filter_samples = 0;
+uint64_t input_filter_ns = 0;
+double input_prediction_error = 0;
+double input_filtered_error = 0;
+
+static void input_time(struct timeval *now) {
+  if (clock_source) {
+    clock_source(now);
+  } else {
+    gettimeofday(now, NULL);
+  }
+}
+
+input_clock input_use_clock(input_clock clock) {
+  input_clock previous = clock_source;
+  clock_source = clock;
+  return previous;
+}
+
+static void set_button(struct wiimote_state *state, enum input_button button,
+                       bool pressed) {
+  switch (button) {
+  case INPUT_BUTTON_HOME:
+    state->usr.home = pressed;
+    break;
+
+  case INPUT_BUTTON_WIIMOTE_UP:
+    state->usr.up = pressed;
+    break;
+  case INPUT_BUTTON_WIIMOTE_DOWN:
+    state->usr.down = pressed;
+    break;
+  case INPUT_BUTTON_WIIMOTE_LEFT:
+    state->usr.left = pressed;
+    break;
+  case INPUT_BUTTON_WIIMOTE_RIGHT:
+    state->usr.right = pressed;
+    break;
+  case INPUT_BUTTON_WIIMOTE_A:
+    state->usr.a = pressed;
+    break;
+  case INPUT_BUTTON_WIIMOTE_B:
+    state->usr.b = pressed;
+    break;
+  case INPUT_BUTTON_WIIMOTE_1:
+    state->usr.one = pressed;
+    break;
+  case INPUT_BUTTON_WIIMOTE_2:
+    state->usr.two = pressed;
+    break;
+  case INPUT_BUTTON_WIIMOTE_PLUS:
+    state->usr.plus = pressed;
+    break;
+  case INPUT_BUTTON_WIIMOTE_MINUS:
+    state->usr.minus = pressed;
+    break;
+
+  case INPUT_BUTTON_NUNCHUK_C:
+    state->usr.nunchuk.c = pressed;
+    break;
+  case INPUT_BUTTON_NUNCHUK_Z:
+    state->usr.nunchuk.z = pressed;
+    break;
+
+  case INPUT_BUTTON_CLASSIC_UP:
+    state->usr.classic.up = pressed;
+    break;
+  case INPUT_BUTTON_CLASSIC_DOWN:
+    state->usr.classic.down = pressed;
+    break;
+  case INPUT_BUTTON_CLASSIC_LEFT:
+    state->usr.classic.left = pressed;
+    break;
+  case INPUT_BUTTON_CLASSIC_RIGHT:
+    state->usr.classic.right = pressed;
+    break;
+  case INPUT_BUTTON_CLASSIC_A:
+    state->usr.classic.a = pressed;
+    break;
+  case INPUT_BUTTON_CLASSIC_B:
+    state->usr.classic.b = pressed;
+    break;
+  case INPUT_BUTTON_CLASSIC_X:
+    state->usr.classic.x = pressed;
+    break;
+  case INPUT_BUTTON_CLASSIC_Y:
+    state->usr.classic.y = pressed;
+    break;
+  case INPUT_BUTTON_CLASSIC_L:
+    state->usr.classic.ltrigger = pressed;
+    break;
+  case INPUT_BUTTON_CLASSIC_R:
+    state->usr.classic.rtrigger = pressed;
+    break;
+  case INPUT_BUTTON_CLASSIC_ZL:
+    state->usr.classic.lz = pressed;
+    break;
+  case INPUT_BUTTON_CLASSIC_ZR:
+    state->usr.classic.rz = pressed;
+    break;
+  case INPUT_BUTTON_CLASSIC_PLUS:
+    state->usr.classic.plus = pressed;
+    break;
+  case INPUT_BUTTON_CLASSIC_MINUS:
+    state->usr.classic.minus = pressed;
+    break;
+  default:
+    printf("warning: button %d not handled by input_update\n", button);
+    break;
+  }
+}
+
+static void mark_sampled(enum interp_channel channel,
+                         struct timeval const *ts) {
+  interp_sampled |= 1 << channel;
+  interp_sample_ts[channel] = *ts;
+}
+
+static void mark_state_sampled(uint16_t fields, struct timeval const *ts) {
+  if (fields & INPUT_STATE_ACCEL) {
+    mark_sampled(INTERP_ACCEL, ts);
+  }
+  if (fields & INPUT_STATE_NUNCHUK) {
+    mark_sampled(INTERP_NUNCHUK, ts);
+  }
+  if (fields & INPUT_STATE_MOTIONPLUS) {
+    mark_sampled(INTERP_MOTIONPLUS, ts);
+  }
+  if (fields & INPUT_STATE_IR) {
+    mark_sampled(INTERP_IR, ts);
+  }
+}
+
+static void apply_state_event(struct wiimote_state *state,
+                              struct input_state_event const *event) {
+  if (event->fields & INPUT_STATE_BUTTONS) {
+    for (int button = 0; button < INPUT_BUTTON_COUNT; button++) {
+      set_button(state, button, (event->buttons >> button) & 1);
+    }
+  }
+
+  if (event->fields & INPUT_STATE_ACCEL) {
+    state->usr.accel_x = event->accel_x;
+    state->usr.accel_y = event->accel_y;
+    state->usr.accel_z = event->accel_z;
+  }
+
+  if (event->fields & INPUT_STATE_IR) {
+    memcpy(state->usr.ir_object, event->ir_object,
+           sizeof(state->usr.ir_object));
+    invalidate_motion_state();
+  }
+
+  if (event->fields & INPUT_STATE_NUNCHUK) {
+    state->usr.nunchuk.x = event->nunchuk_x;
+    state->usr.nunchuk.y = event->nunchuk_y;
+    state->usr.nunchuk.accel_x = event->nunchuk_accel_x;
+    state->usr.nunchuk.accel_y = event->nunchuk_accel_y;
+    state->usr.nunchuk.accel_z = event->nunchuk_accel_z;
+  }
+
+  if (event->fields & INPUT_STATE_CLASSIC) {
+    state->usr.classic.ls_x = event->classic_ls_x;
+    state->usr.classic.ls_y = event->classic_ls_y;
+    state->usr.classic.rs_x = event->classic_rs_x;
+    state->usr.classic.rs_y = event->classic_rs_y;
+    state->usr.classic.lt = event->classic_lt;
+    state->usr.classic.rt = event->classic_rt;
+  }
+
+  if (event->fields & INPUT_STATE_MOTIONPLUS) {
+    set_motionplus_rates(state, event->motionplus_yaw, event->motionplus_roll,
+                         event->motionplus_pitch);
+  }
+
+  external_fields |= event->fields;
+}
+
+// Absolute samples where only the newest one of a tick matters
+#define SAMPLE_CHANNELS 3
+
+static int sample_channel(struct input_event const *event) {
+  if (event->type == INPUT_EVENT_TYPE_IR) {
+    return 2;
+  }
+  if (event->type != INPUT_EVENT_TYPE_ANALOG_MOTION) {
+    return -1;
+  }
+  switch (event->analog_motion_event.motion) {
+  case INPUT_ANALOG_MOTION_IR_RAW:
+    return 0;
+  case INPUT_ANALOG_MOTION_ACCEL:
+    return 1;
+  default:
+    return -1;
+  }
+}
+
+uint16_t input_event_fields(struct input_event const *event) {
+  switch (event->type) {
+  case INPUT_EVENT_TYPE_BUTTON:
+    return INPUT_STATE_BUTTONS;
+  case INPUT_EVENT_TYPE_STATE:
+    return event->state_event.fields;
+  case INPUT_EVENT_TYPE_IR:
+    return INPUT_STATE_IR;
+  case INPUT_EVENT_TYPE_POSE:
+    return POSE_STATE_FIELDS;
+  case INPUT_EVENT_TYPE_HOTPLUG:
+    // a hotplug resets the IR objects and the new extension's inputs
+    switch (event->hotplug_event.extension) {
+    case Nunchuk:
+      return INPUT_STATE_IR | INPUT_STATE_NUNCHUK;
+    case Classic:
+      return INPUT_STATE_IR | INPUT_STATE_CLASSIC;
+    default:
+      return INPUT_STATE_IR;
+    }
+  case INPUT_EVENT_TYPE_ANALOG_MOTION:
+    switch (event->analog_motion_event.motion) {
+    case INPUT_ANALOG_MOTION_POINTER:
+    case INPUT_ANALOG_MOTION_IR_UP:
+    case INPUT_ANALOG_MOTION_IR_DOWN:
+    case INPUT_ANALOG_MOTION_IR_LEFT:
+    case INPUT_ANALOG_MOTION_IR_RIGHT:
+    case INPUT_ANALOG_MOTION_IR_RAW:
+      return INPUT_STATE_IR;
+    case INPUT_ANALOG_MOTION_ACCEL:
+    case INPUT_ANALOG_MOTION_STEER_LEFT:
+    case INPUT_ANALOG_MOTION_STEER_RIGHT:
+      return INPUT_STATE_ACCEL;
+    case INPUT_ANALOG_MOTION_NUNCHUK_UP:
+    case INPUT_ANALOG_MOTION_NUNCHUK_DOWN:
+    case INPUT_ANALOG_MOTION_NUNCHUK_LEFT:
+    case INPUT_ANALOG_MOTION_NUNCHUK_RIGHT:
+      return INPUT_STATE_NUNCHUK;
+    case INPUT_ANALOG_MOTION_CLASSIC_LEFT_STICK_UP:
+    case INPUT_ANALOG_MOTION_CLASSIC_LEFT_STICK_DOWN:
+    case INPUT_ANALOG_MOTION_CLASSIC_LEFT_STICK_LEFT:
+    case INPUT_ANALOG_MOTION_CLASSIC_LEFT_STICK_RIGHT:
+      return INPUT_STATE_CLASSIC;
+    case INPUT_ANALOG_MOTION_MOTIONPLUS_UP:
+    case INPUT_ANALOG_MOTION_MOTIONPLUS_DOWN:
+    case INPUT_ANALOG_MOTION_MOTIONPLUS_LEFT:
+    case INPUT_ANALOG_MOTION_MOTIONPLUS_RIGHT:
+    case INPUT_ANALOG_MOTION_MOTIONPLUS_SLOW:
+      return INPUT_STATE_MOTIONPLUS;
+    }
+    return 0;
+  default:
+    return 0;
+  }
+}
+
+/* Applies one event, returns -1 or -2 for the emulator controls that end
+ * input_update */
+static int apply_event(struct wiimote_state *state,
+                       struct input_event const *event, float *pointer_delta_x,
+                       float *pointer_delta_y) {
+  // leaving the pose hands the fields it set back to their usual sources
+  if (pose_input && event->type != INPUT_EVENT_TYPE_POSE &&
+      event->type != INPUT_EVENT_TYPE_HOTPLUG &&
+      (input_event_fields(event) & POSE_STATE_FIELDS)) {
+    pose_input = false;
+    external_fields &= ~POSE_STATE_FIELDS;
+  }
+
+  switch (event->type) {
+  case INPUT_EVENT_TYPE_EMULATOR_CONTROL:
+    switch (event->emulator_control_event.control) {
+    case INPUT_EMULATOR_CONTROL_QUIT:
+      return -1;
+    case INPUT_EMULATOR_CONTROL_POWER_OFF:
+      return -2;
+    case INPUT_EMULATOR_CONTROL_TOGGLE_REPORTS:
+      show_reports = (show_reports + 1) % 2;
+      break;
+    }
+    break;
+  case INPUT_EVENT_TYPE_HOTPLUG:
+    invalidate_motion_state();
+    interp_reset();
+    switch (event->hotplug_event.extension) {
+    case Nunchuk:
+      reset_input_nunchuk(&state->usr.nunchuk);
+      reset_input_ir(state->usr.ir_object);
+      break;
+    case Classic:
+      reset_input_classic(&state->usr.classic);
+      reset_input_ir(state->usr.ir_object);
+      break;
+    case BalanceBoard:
+      reset_input_ir(state->usr.ir_object);
+      break;
+    case NoExtension:
+      reset_input_ir(state->usr.ir_object);
+      pointer_x = 0.5;
+      pointer_y = 0.5;
+      // restart the filter and MotionPlus at the centre instead of gliding
+      // or turning back to it
+      pointer_filter_x.ready = pointer_filter_y.ready = false;
+      reset_pointer_motion();
+      pointer_sampled = true;
+      pointer_sample_ts = event->ts;
+      break;
+    default:
+      goto invalid;
+    }
+
+    state->usr.connected_extension_type = event->hotplug_event.extension;
+  invalid:
+    break;
+  case INPUT_EVENT_TYPE_BUTTON: {
+    pending_button_ts = event->ts;
+    set_button(state, event->button_event.button,
+               event->button_event.pressed);
+    break;
+  }
+  case INPUT_EVENT_TYPE_ANALOG_MOTION: {
+    bool moving = event->analog_motion_event.moving;
+    external_fields &= ~input_event_fields(event);
+
+    switch (event->analog_motion_event.motion) {
+    case INPUT_ANALOG_MOTION_POINTER:
+      pointer_sampled = true;
+      pointer_sample_ts = event->ts;
+      *pointer_delta_x = event->analog_motion_event.delta_x;
+      *pointer_delta_y = event->analog_motion_event.delta_y;
+      /* printf("pointer: %f %f\n", event->analog_motion_event.x, */
+      /*        event->analog_motion_event.y); */
+      /* pointer_x = event->analog_motion_event.x; */
+      /* pointer_y = event->analog_motion_event.y; */
+      break;
+    case INPUT_ANALOG_MOTION_IR_UP:
+      ir_up = moving;
+      break;
+    case INPUT_ANALOG_MOTION_IR_DOWN:
+      ir_down = moving;
+      break;
+    case INPUT_ANALOG_MOTION_IR_LEFT:
+      ir_left = moving;
+      break;
+    case INPUT_ANALOG_MOTION_IR_RIGHT:
+      ir_right = moving;
+      break;
+    case INPUT_ANALOG_MOTION_IR_RAW: {
+      /*
+        Use the received IR values to update the wiimote’s IR object.
+        For example, assume the IR x and y are normalized in [0,1] and z
+        represents an intensity or size.
+      */
+      /* printf("IR RAW: %f %f\n", event->analog_motion_event.x, */
+      /*        event->analog_motion_event.y); */
+      /* state->usr.ir_object[0].x = round(event->analog_motion_event.x *
+       * 1023); */
+      /* state->usr.ir_object[0].y = round(event->analog_motion_event.y * 767);
+       */
+      pending_ir_ts = event->ts;
+      pointer_sampled = true;
+      pointer_sample_ts = event->ts;
+      pointer_x = event->analog_motion_event.x;
+      pointer_y = event->analog_motion_event.y;
+      /* Map the IR z value to a size between, say, 1 and 15.
+        (Adjust this mapping to match your device’s characteristics.) */
+      /* state->usr.ir_object[0].size = round(1.0 +
+       * event->analog_motion_event.z * 14); */
+      break;
+    }
+
+    case INPUT_ANALOG_MOTION_ACCEL: {
+      /* printf("ACCEL: %f %f %f\n", event->analog_motion_event.x, */
+      /*        event->analog_motion_event.y, event->analog_motion_event.z); */
+
+      /* event->analog_motion_event.x = */
+      /*     fmax(-3.4, fmin(3.4, event->analog_motion_event.x)); */
+      /* event->analog_motion_event.y = */
+      /*     fmax(-3.4, fmin(3.4, event->analog_motion_event.y)); */
+      /* event->analog_motion_event.z = */
+      /*     fmax(-3.4, fmin(3.4, event->analog_motion_event.z)); */
+
+      /* state->usr.accel_x = */
+      /*     accelerometer_zero + */
+      /*     (int)round(accelerometer_unit * -event->analog_motion_event.x); */
+      /* state->usr.accel_y = */
+      /*     accelerometer_zero + */
+      /*     (int)round(accelerometer_unit * event->analog_motion_event.z); */
+      /* state->usr.accel_z = */
+      /*     accelerometer_zero + */
+      /*     (int)round(accelerometer_unit * -event->analog_motion_event.y); */
+
+      pending_accel_ts = event->ts;
+      mark_sampled(INTERP_ACCEL, &event->ts);
+      state->usr.accel_x = event->analog_motion_event.x;
+      state->usr.accel_y = event->analog_motion_event.y;
+      state->usr.accel_z = event->analog_motion_event.z;
+
+      /* printf("ACCEL: %d %d %d\n", state->usr.accel_x, state->usr.accel_y,
+       */
+      /*        state->usr.accel_z); */
+
+      break;
+    }
+
+    case INPUT_ANALOG_MOTION_STEER_LEFT:
+      steer_left = moving;
+      break;
+    case INPUT_ANALOG_MOTION_STEER_RIGHT:
+      steer_right = moving;
+      break;
+
+    case INPUT_ANALOG_MOTION_NUNCHUK_UP:
+      nunchuk_up = moving;
+      break;
+    case INPUT_ANALOG_MOTION_NUNCHUK_DOWN:
+      nunchuk_down = moving;
+      break;
+    case INPUT_ANALOG_MOTION_NUNCHUK_LEFT:
+      nunchuk_left = moving;
+      break;
+    case INPUT_ANALOG_MOTION_NUNCHUK_RIGHT:
+      nunchuk_right = moving;
+      break;
+
+    case INPUT_ANALOG_MOTION_CLASSIC_LEFT_STICK_UP:
+      classic_left_stick_up = moving;
+      break;
+    case INPUT_ANALOG_MOTION_CLASSIC_LEFT_STICK_DOWN:
+      classic_left_stick_down = moving;
+      break;
+    case INPUT_ANALOG_MOTION_CLASSIC_LEFT_STICK_LEFT:
+      classic_left_stick_left = moving;
+      break;
+    case INPUT_ANALOG_MOTION_CLASSIC_LEFT_STICK_RIGHT:
+      classic_left_stick_right = moving;
+      break;
+
+    case INPUT_ANALOG_MOTION_MOTIONPLUS_UP:
+      motionplus_up = moving;
+      break;
+    case INPUT_ANALOG_MOTION_MOTIONPLUS_DOWN:
+      motionplus_down = moving;
+      break;
+    case INPUT_ANALOG_MOTION_MOTIONPLUS_LEFT:
+      motionplus_left = moving;
+      break;
+    case INPUT_ANALOG_MOTION_MOTIONPLUS_RIGHT:
+      motionplus_right = moving;
+      break;
+    case INPUT_ANALOG_MOTION_MOTIONPLUS_SLOW:
+      motionplus_slow = moving;
+      break;
+    }
+    break;
+  }
+  case INPUT_EVENT_TYPE_STATE:
+    if (event->state_event.fields & INPUT_STATE_BUTTONS) {
+      pending_button_ts = event->ts;
+    }
+    if (event->state_event.fields & INPUT_STATE_ACCEL) {
+      pending_accel_ts = event->ts;
+    }
+    if (event->state_event.fields & INPUT_STATE_IR) {
+      pending_ir_ts = event->ts;
+    }
+    mark_state_sampled(event->state_event.fields, &event->ts);
+    apply_state_event(state, &event->state_event);
+    break;
+  case INPUT_EVENT_TYPE_IR:
+    pending_ir_ts = event->ts;
+    mark_sampled(INTERP_IR, &event->ts);
+    memcpy(state->usr.ir_object, event->ir_event.ir_object,
+           sizeof(state->usr.ir_object));
+    invalidate_motion_state();
+    external_fields |= INPUT_STATE_IR;
+    break;
+  case INPUT_EVENT_TYPE_POSE: {
+    struct input_pose_event const *pose = &event->pose_event;
+    pending_ir_ts = event->ts;
+    pending_accel_ts = event->ts;
+    set_pose_state(
+        state, pose->fields & INPUT_POSE_POSITION ? pose->position : NULL,
+        pose->fields & INPUT_POSE_ORIENTATION ? pose->orientation : NULL,
+        pose->fields & INPUT_POSE_RATES ? pose->rates : NULL, &event->ts);
+    external_fields |= POSE_STATE_FIELDS;
+    pose_input = true;
+    break;
+  }
+  default:
+    break;
+  }
+
+  return 0;
+}
+
+static uint64_t elapsed_ns(struct timespec const *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000000ull + now.tv_nsec -
+         start->tv_nsec;
+}
+
+static void filter_pointer(struct timeval const *ts) {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // how far the previous estimate was from this sample, with and without
+  // extrapolating it
+  if (pointer_filter_x.ready) {
+    input_prediction_error +=
+        hypot(one_euro_predict(&pointer_filter_x, ts, pointer_max_lead) -
+                  pointer_x,
+              one_euro_predict(&pointer_filter_y, ts, pointer_max_lead) -
+                  pointer_y);
+    input_filtered_error += hypot(pointer_filter_x.value - pointer_x,
+                                  pointer_filter_y.value - pointer_y);
+  }
+
+  one_euro_update(&pointer_filter_x, pointer_x, ts);
+  one_euro_update(&pointer_filter_y, pointer_y, ts);
+
+  input_filter_samples++;
+  input_filter_ns += elapsed_ns(&start);
+}
+
+void input_use_pointer_filter(double min_cutoff, double beta,
+                              double speed_cutoff, double lead) {
+  one_euro_init(&pointer_filter_x, min_cutoff, beta, speed_cutoff);
+  one_euro_init(&pointer_filter_y, min_cutoff, beta, speed_cutoff);
+  pointer_lead = fmin(lead, pointer_max_lead);
+  pointer_filter = true;
+}
+
+void input_use_interpolation(double delay, double max_extrapolation) {
+  interp_init(delay, max_extrapolation);
+  interpolation = true;
+}
+
+// Only channels that hold what producers sent are interpolated, not the ones
+// the pointer model, the pose or the digital actions derive each tick.
+static void interpolate(struct wiimote_state *state,
+                        struct timeval const *now) {
+  uint16_t sent = external_fields | INPUT_STATE_ACCEL;
+  if (pose_input) {
+    sent &= ~POSE_STATE_FIELDS;
+  }
+
+  unsigned channels = 0;
+  if (sent & INPUT_STATE_ACCEL) {
+    channels |= 1 << INTERP_ACCEL;
+  }
+  if (sent & INPUT_STATE_NUNCHUK) {
+    channels |= 1 << INTERP_NUNCHUK;
+  }
+  if (sent & INPUT_STATE_MOTIONPLUS) {
+    channels |= 1 << INTERP_MOTIONPLUS;
+  }
+  if (sent & INPUT_STATE_IR) {
+    channels |= 1 << INTERP_IR;
+  }
+  interp_apply(state, channels, now);
+}
+
+void input_prepare_report(struct wiimote_state *state) {
+  struct timeval now;
+  input_time(&now);
+
+  if (pointer_filter && !pointer_filter_x.ready && !input_raw_ir &&
+      !(external_fields & INPUT_STATE_IR)) {
+    // nothing to filter before the first pointer sample
+    set_motion_state(state, pointer_x, pointer_y);
+  } else if (pointer_filter && !input_raw_ir &&
+             !(external_fields & INPUT_STATE_IR)) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct timeval lead = {0, pointer_lead * 1000000}, at;
+    timeradd(&now, &lead, &at);
+    float x = one_euro_predict(&pointer_filter_x, &at, pointer_max_lead);
+    float y = one_euro_predict(&pointer_filter_y, &at, pointer_max_lead);
+    input_filter_ns += elapsed_ns(&start);
+
+    set_motion_state(state,
+                     fmax(-POINTER_MARGIN, fmin(1.0 + POINTER_MARGIN, x)),
+                     fmax(-POINTER_MARGIN, fmin(1.0 + POINTER_MARGIN, y)));
+  }
+
+  if (interpolation) {
+    interpolate(state, &now);
+  }
+
+  if (external_fields & INPUT_STATE_MOTIONPLUS) {
+    return;
+  }
+
+  float rate = motionplus_slow ? motionplus_slow_rate : motionplus_fast_rate;
+  synthesize_motionplus(state, (motionplus_left - motionplus_right) * rate, 0,
+                        (motionplus_down - motionplus_up) * rate, &now);
+}
+
+void input_report_sent(void) {
+  input_reports_sent++;
+}
+
+void input_report_turn(void) { input_report_turns++; }
+
+void input_use_ir_table(void) {
+  double error = build_ir_table(-POINTER_MARGIN, 1.0 + POINTER_MARGIN);
+  printf("IR lookup table: max error %.3f camera pixels\n", error);
+  if (error > IR_TABLE_MAX_ERROR) {
+    printf("warning: IR lookup table is off by more than %.1f camera pixels\n",
+           IR_TABLE_MAX_ERROR);
+  }
+}
+
+/* Applies a held sample at its own time, but counts its latency from the
+ * first sample it replaced this tick */
+static void apply_sample(struct wiimote_state *state,
+                         struct input_event const *sample,
+                         struct timeval const *first_ts,
+                         float *pointer_delta_x, float *pointer_delta_y) {
+  apply_event(state, sample, pointer_delta_x, pointer_delta_y);
+  if (sample_channel(sample) == 1) {
+    pending_accel_ts = *first_ts;
+  } else {
+    pending_ir_ts = *first_ts;
+  }
+}
 
 int input_update(struct wiimote_state *state,
                  struct input_source const *source) {
   struct input_event event;
+  struct input_event sample[SAMPLE_CHANNELS];
+  struct timeval first_ts[SAMPLE_CHANNELS];
+  bool held[SAMPLE_CHANNELS] = {false};
 
   float pointer_delta_x = 0, pointer_delta_y = 0;
 
   /* Loop through waiting messages and process them */
 
+  memset(&event.ts, 0, sizeof(event.ts));
   while (source->poll_event(&event)) {
-    switch (event.type) {
-    case INPUT_EVENT_TYPE_EMULATOR_CONTROL:
-      switch (event.emulator_control_event.control) {
-      case INPUT_EMULATOR_CONTROL_QUIT:
-        return -1;
-      case INPUT_EMULATOR_CONTROL_POWER_OFF:
-        return -2;
-      case INPUT_EMULATOR_CONTROL_TOGGLE_REPORTS:
-        show_reports = (show_reports + 1) % 2;
-        break;
-      }
-      break;
-    case INPUT_EVENT_TYPE_HOTPLUG:
-      switch (event.hotplug_event.extension) {
-      case Nunchuk:
-        reset_input_nunchuk(&state->usr.nunchuk);
-        reset_input_ir(state->usr.ir_object);
-        break;
-      case Classic:
-        reset_input_classic(&state->usr.classic);
-        reset_input_ir(state->usr.ir_object);
-        break;
-      case BalanceBoard:
-        reset_input_ir(state->usr.ir_object);
-        break;
-      case NoExtension:
-        reset_input_ir(state->usr.ir_object);
-        pointer_x = 0.5;
-        pointer_y = 0.5;
-        break;
-      default:
-        goto invalid;
-      }
+    // sources that don't timestamp their events get the time they're drained
+    if (event.ts.tv_sec == 0 && event.ts.tv_usec == 0) {
+      input_time(&event.ts);
+    }
+    latest_input_ts = event.ts;
 
-      state->usr.connected_extension_type = event.hotplug_event.extension;
-    invalid:
-      break;
-    case INPUT_EVENT_TYPE_BUTTON: {
-      pending_button_ts = event.ts;
-      bool pressed = event.button_event.pressed;
-      switch (event.button_event.button) {
-      case INPUT_BUTTON_HOME:
-        state->usr.home = pressed;
-        break;
-
-      case INPUT_BUTTON_WIIMOTE_UP:
-        state->usr.up = pressed;
-        break;
-      case INPUT_BUTTON_WIIMOTE_DOWN:
-        state->usr.down = pressed;
-        break;
-      case INPUT_BUTTON_WIIMOTE_LEFT:
-        state->usr.left = pressed;
-        break;
-      case INPUT_BUTTON_WIIMOTE_RIGHT:
-        state->usr.right = pressed;
-        break;
-      case INPUT_BUTTON_WIIMOTE_A:
-        state->usr.a = pressed;
-        break;
-      case INPUT_BUTTON_WIIMOTE_B:
-        state->usr.b = pressed;
-        break;
-      case INPUT_BUTTON_WIIMOTE_1:
-        state->usr.one = pressed;
-        break;
-      case INPUT_BUTTON_WIIMOTE_2:
-        state->usr.two = pressed;
-        break;
-      case INPUT_BUTTON_WIIMOTE_PLUS:
-        state->usr.plus = pressed;
-        break;
-      case INPUT_BUTTON_WIIMOTE_MINUS:
-        state->usr.minus = pressed;
-        break;
-
-      case INPUT_BUTTON_NUNCHUK_C:
-        state->usr.nunchuk.c = pressed;
-        break;
-      case INPUT_BUTTON_NUNCHUK_Z:
-        state->usr.nunchuk.z = pressed;
-        break;
-
-      case INPUT_BUTTON_CLASSIC_UP:
-        state->usr.classic.up = pressed;
-        break;
-      case INPUT_BUTTON_CLASSIC_DOWN:
-        state->usr.classic.down = pressed;
-        break;
-      case INPUT_BUTTON_CLASSIC_LEFT:
-        state->usr.classic.left = pressed;
-        break;
-      case INPUT_BUTTON_CLASSIC_RIGHT:
-        state->usr.classic.right = pressed;
-        break;
-      case INPUT_BUTTON_CLASSIC_A:
-        state->usr.classic.a = pressed;
-        break;
-      case INPUT_BUTTON_CLASSIC_B:
-        state->usr.classic.b = pressed;
-        break;
-      case INPUT_BUTTON_CLASSIC_X:
-        state->usr.classic.x = pressed;
-        break;
-      case INPUT_BUTTON_CLASSIC_Y:
-        state->usr.classic.y = pressed;
-        break;
-      case INPUT_BUTTON_CLASSIC_L:
-        state->usr.classic.ltrigger = pressed;
-        break;
-      case INPUT_BUTTON_CLASSIC_R:
-        state->usr.classic.rtrigger = pressed;
-        break;
-      case INPUT_BUTTON_CLASSIC_ZL:
-        state->usr.classic.lz = pressed;
-        break;
-      case INPUT_BUTTON_CLASSIC_ZR:
-        state->usr.classic.rz = pressed;
-        break;
-      case INPUT_BUTTON_CLASSIC_PLUS:
-        state->usr.classic.plus = pressed;
-        break;
-      case INPUT_BUTTON_CLASSIC_MINUS:
-        state->usr.classic.minus = pressed;
-        break;
-      default:
-        printf("warning: button %d not handled by input_update\n",
-               event.button_event.button);
-        break;
+    // an absolute sample is held back until a newer one replaces it or
+    // another event touches the same part of the state
+    int channel = sample_channel(&event);
+    uint16_t fields = input_event_fields(&event);
+    for (int other = 0; other < SAMPLE_CHANNELS; other++) {
+      if (other != channel && held[other] &&
+          (input_event_fields(&sample[other]) & fields)) {
+        apply_sample(state, &sample[other], &first_ts[other],
+                     &pointer_delta_x, &pointer_delta_y);
+        held[other] = false;
       }
-      break;
     }
-    case INPUT_EVENT_TYPE_ANALOG_MOTION: {
-      bool moving = event.analog_motion_event.moving;
-      switch (event.analog_motion_event.motion) {
-      case INPUT_ANALOG_MOTION_POINTER:
-        pointer_delta_x = event.analog_motion_event.delta_x;
-        pointer_delta_y = event.analog_motion_event.delta_y;
-        /* printf("pointer: %f %f\n", event.analog_motion_event.x, */
-        /*        event.analog_motion_event.y); */
-        /* pointer_x = event.analog_motion_event.x; */
-        /* pointer_y = event.analog_motion_event.y; */
-        break;
-      case INPUT_ANALOG_MOTION_IR_UP:
-        ir_up = moving;
-        break;
-      case INPUT_ANALOG_MOTION_IR_DOWN:
-        ir_down = moving;
-        break;
-      case INPUT_ANALOG_MOTION_IR_LEFT:
-        ir_left = moving;
-        break;
-      case INPUT_ANALOG_MOTION_IR_RIGHT:
-        ir_right = moving;
-        break;
-      case INPUT_ANALOG_MOTION_IR_RAW: {
-        /*
-          Use the received IR values to update the wiimote’s IR object.
-          For example, assume the IR x and y are normalized in [0,1] and z
-          represents an intensity or size.
-        */
-        /* printf("IR RAW: %f %f\n", event.analog_motion_event.x, */
-        /*        event.analog_motion_event.y); */
-        /* state->usr.ir_object[0].x = round(event.analog_motion_event.x *
-         * 1023); */
-        /* state->usr.ir_object[0].y = round(event.analog_motion_event.y * 767);
-         */
-        pending_ir_ts = event.ts;
-        pointer_x = event.analog_motion_event.x;
-        pointer_y = event.analog_motion_event.y;
-        /* Map the IR z value to a size between, say, 1 and 15.
-          (Adjust this mapping to match your device’s characteristics.) */
-        /* state->usr.ir_object[0].size = round(1.0 +
-         * event.analog_motion_event.z * 14); */
-        break;
-      }
-
-      case INPUT_ANALOG_MOTION_ACCEL: {
-        /* printf("ACCEL: %f %f %f\n", event.analog_motion_event.x, */
-        /*        event.analog_motion_event.y, event.analog_motion_event.z); */
-
-        /* event.analog_motion_event.x = */
-        /*     fmax(-3.4, fmin(3.4, event.analog_motion_event.x)); */
-        /* event.analog_motion_event.y = */
-        /*     fmax(-3.4, fmin(3.4, event.analog_motion_event.y)); */
-        /* event.analog_motion_event.z = */
-        /*     fmax(-3.4, fmin(3.4, event.analog_motion_event.z)); */
-
-        /* state->usr.accel_x = */
-        /*     accelerometer_zero + */
-        /*     (int)round(accelerometer_unit * -event.analog_motion_event.x); */
-        /* state->usr.accel_y = */
-        /*     accelerometer_zero + */
-        /*     (int)round(accelerometer_unit * event.analog_motion_event.z); */
-        /* state->usr.accel_z = */
-        /*     accelerometer_zero + */
-        /*     (int)round(accelerometer_unit * -event.analog_motion_event.y); */
-
-        pending_accel_ts = event.ts;
-        state->usr.accel_x = event.analog_motion_event.x;
-        state->usr.accel_y = event.analog_motion_event.y;
-        state->usr.accel_z = event.analog_motion_event.z;
-
-        /* printf("ACCEL: %d %d %d\n", state->usr.accel_x, state->usr.accel_y,
-         */
-        /*        state->usr.accel_z); */
-
-        break;
+    if (channel >= 0) {
+      if (held[channel]) {
+        input_coalesced_events++;
+      } else {
+        first_ts[channel] = event.ts;
       }
+      sample[channel] = event;
+      held[channel] = true;
+      memset(&event.ts, 0, sizeof(event.ts));
+      continue;
+    }
 
-      case INPUT_ANALOG_MOTION_STEER_LEFT:
-        steer_left = moving;
-        break;
-      case INPUT_ANALOG_MOTION_STEER_RIGHT:
-        steer_right = moving;
-        break;
-
-      case INPUT_ANALOG_MOTION_NUNCHUK_UP:
-        nunchuk_up = moving;
-        break;
-      case INPUT_ANALOG_MOTION_NUNCHUK_DOWN:
-        nunchuk_down = moving;
-        break;
-      case INPUT_ANALOG_MOTION_NUNCHUK_LEFT:
-        nunchuk_left = moving;
-        break;
-      case INPUT_ANALOG_MOTION_NUNCHUK_RIGHT:
-        nunchuk_right = moving;
-        break;
-
-      case INPUT_ANALOG_MOTION_CLASSIC_LEFT_STICK_UP:
-        classic_left_stick_up = moving;
-        break;
-      case INPUT_ANALOG_MOTION_CLASSIC_LEFT_STICK_DOWN:
-        classic_left_stick_down = moving;
-        break;
-      case INPUT_ANALOG_MOTION_CLASSIC_LEFT_STICK_LEFT:
-        classic_left_stick_left = moving;
-        break;
-      case INPUT_ANALOG_MOTION_CLASSIC_LEFT_STICK_RIGHT:
-        classic_left_stick_right = moving;
-        break;
-
-      case INPUT_ANALOG_MOTION_MOTIONPLUS_UP:
-        motionplus_up = moving;
-        break;
-      case INPUT_ANALOG_MOTION_MOTIONPLUS_DOWN:
-        motionplus_down = moving;
-        break;
-      case INPUT_ANALOG_MOTION_MOTIONPLUS_LEFT:
-        motionplus_left = moving;
-        break;
-      case INPUT_ANALOG_MOTION_MOTIONPLUS_RIGHT:
-        motionplus_right = moving;
-        break;
-      case INPUT_ANALOG_MOTION_MOTIONPLUS_SLOW:
-        motionplus_slow = moving;
-        break;
-      }
-      break;
+    int result = apply_event(state, &event, &pointer_delta_x, &pointer_delta_y);
+    if (result) {
+      return result;
     }
-    default:
-      break;
+
+    memset(&event.ts, 0, sizeof(event.ts));
+  }
+
+  for (int channel = 0; channel < SAMPLE_CHANNELS; channel++) {
+    if (held[channel]) {
+      apply_sample(state, &sample[channel], &first_ts[channel],
+                   &pointer_delta_x, &pointer_delta_y);
     }
   }
 
   pointer_delta_x += ir_right * 0.004 - ir_left * 0.004;
   pointer_delta_y += ir_up * 0.004 - ir_down * 0.004;
 
-  pointer_x = fmax(-pointer_margin,
-                   fmin(1.0 + pointer_margin, pointer_x + pointer_delta_x));
-  pointer_y = fmax(-pointer_margin,
-                   fmin(1.0 + pointer_margin, pointer_y + pointer_delta_y));
+  pointer_x = fmax(-POINTER_MARGIN,
+                   fmin(1.0 + POINTER_MARGIN, pointer_x + pointer_delta_x));
+  pointer_y = fmax(-POINTER_MARGIN,
+                   fmin(1.0 + POINTER_MARGIN, pointer_y + pointer_delta_y));
+
+  // the pose keeps turning between pose events
+  if (pose_input) {
+    struct timeval now;
+    input_time(&now);
+    set_pose_state(state, NULL, NULL, NULL, &now);
+  }
+
+  if (pointer_sampled || pointer_delta_x != 0 || pointer_delta_y != 0) {
+    struct timeval ts = pointer_sample_ts;
+    if (!pointer_sampled) {
+      input_time(&ts);
+    }
+    if (pointer_filter) {
+      filter_pointer(&ts);
+    }
+    // MotionPlus turns with the pointer model, as smooth as the filter has it
+    if (!input_raw_ir && !(external_fields & INPUT_STATE_IR)) {
+      sample_pointer_motion(
+          pointer_filter ? pointer_filter_x.value : pointer_x,
+          pointer_filter ? pointer_filter_y.value : pointer_y, &ts);
+    }
+  }
+  pointer_sampled = false;
 
-  set_motion_state(state, pointer_x, pointer_y);
+  // with the filter, the pointer model runs when the report is built
+  if (!pointer_filter && !input_raw_ir && !(external_fields & INPUT_STATE_IR)) {
+    set_motion_state(state, pointer_x, pointer_y);
+  }
   /* set_exact_pointer_state(state, pointer_x, pointer_y); */
 
-  state->usr.nunchuk.x = 128 + nunchuk_right * 100 - nunchuk_left * 100;
-  state->usr.nunchuk.y = 128 + nunchuk_up * 100 - nunchuk_down * 100;
-
-  state->usr.classic.ls_x =
-      32 + classic_left_stick_right * 30 - classic_left_stick_left * 30;
-  state->usr.classic.ls_y =
-      32 + classic_left_stick_up * 30 - classic_left_stick_down * 30;
-
-  state->usr.motionplus.pitch_left =
-      0x1F7F + motionplus_down * 800 * (1 + !motionplus_slow) -
-      motionplus_up * 800 * (1 + !motionplus_slow);
-  state->usr.motionplus.yaw_down =
-      0x1F7F + motionplus_left * 800 * (1 + !motionplus_slow) -
-      motionplus_right * 800 * (1 + !motionplus_slow);
-  state->usr.motionplus.pitch_slow = motionplus_slow;
-  state->usr.motionplus.yaw_slow = motionplus_slow;
+  if (!(external_fields & INPUT_STATE_NUNCHUK)) {
+    state->usr.nunchuk.x = 128 + nunchuk_right * 100 - nunchuk_left * 100;
+    state->usr.nunchuk.y = 128 + nunchuk_up * 100 - nunchuk_down * 100;
+  }
+
+  if (!(external_fields & INPUT_STATE_CLASSIC)) {
+    state->usr.classic.ls_x =
+        32 + classic_left_stick_right * 30 - classic_left_stick_left * 30;
+    state->usr.classic.ls_y =
+        32 + classic_left_stick_up * 30 - classic_left_stick_down * 30;
+  }
+
+  // the samples are taken once the tick's events are all applied
+  for (int channel = 0; interpolation && channel < INTERP_CHANNELS;
+       channel++) {
+    if (interp_sampled & (1 << channel)) {
+      interp_sample(state, channel, &interp_sample_ts[channel]);
+    }
+  }
+  interp_sampled = 0;
 
   return 0;
 }
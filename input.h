@@ -12,6 +12,9 @@ enum input_event_type {
   INPUT_EVENT_TYPE_HOTPLUG,
   INPUT_EVENT_TYPE_BUTTON,
   INPUT_EVENT_TYPE_ANALOG_MOTION,
+  INPUT_EVENT_TYPE_STATE,
+  INPUT_EVENT_TYPE_IR,
+  INPUT_EVENT_TYPE_POSE,
 };
 
 enum input_emulator_control {
@@ -60,6 +63,8 @@ enum input_button {
   INPUT_BUTTON_CLASSIC_ZR,
   INPUT_BUTTON_CLASSIC_PLUS,
   INPUT_BUTTON_CLASSIC_MINUS,
+
+  INPUT_BUTTON_COUNT
 };
 
 struct input_button_event {
@@ -109,6 +114,69 @@ struct input_analog_motion_event {
   enum input_analog_motion motion;
 };
 
+// Parts of the controller state carried by a state event
+enum input_state_field {
+  INPUT_STATE_BUTTONS = 1 << 0,
+  INPUT_STATE_ACCEL = 1 << 1,
+  INPUT_STATE_IR = 1 << 2,
+  INPUT_STATE_NUNCHUK = 1 << 3,
+  INPUT_STATE_CLASSIC = 1 << 4,
+  INPUT_STATE_MOTIONPLUS = 1 << 5,
+};
+
+// Whole controller state at once, only the parts named in fields are set
+struct input_state_event {
+  uint16_t fields;
+  uint32_t seq;
+
+  uint32_t buttons; // bit n set: enum input_button n pressed
+
+  uint16_t accel_x;
+  uint16_t accel_y;
+  uint16_t accel_z;
+
+  struct wiimote_ir_object ir_object[4];
+
+  uint8_t nunchuk_x;
+  uint8_t nunchuk_y;
+  uint16_t nunchuk_accel_x;
+  uint16_t nunchuk_accel_y;
+  uint16_t nunchuk_accel_z;
+
+  uint8_t classic_ls_x;
+  uint8_t classic_ls_y;
+  uint8_t classic_rs_x;
+  uint8_t classic_rs_y;
+  uint8_t classic_lt;
+  uint8_t classic_rt;
+
+  // degrees per second
+  float motionplus_yaw;
+  float motionplus_roll;
+  float motionplus_pitch;
+};
+
+// All four IR objects as the camera reports them
+struct input_ir_event {
+  struct wiimote_ir_object ir_object[4];
+};
+
+// Parts of the controller pose carried by a pose event
+enum input_pose_field {
+  INPUT_POSE_POSITION = 1 << 0,
+  INPUT_POSE_ORIENTATION = 1 << 1,
+  INPUT_POSE_RATES = 1 << 2,
+};
+
+// Controller pose driving the accelerometer, IR and MotionPlus together, only
+// the parts named in fields are set. See set_pose_state for the units.
+struct input_pose_event {
+  uint8_t fields;
+  float position[3];    // x, y, z
+  float orientation[4]; // w, x, y, z
+  float rates[3];       // yaw, roll, pitch
+};
+
 struct input_event {
   enum input_event_type type;
   union {
@@ -116,6 +184,9 @@ struct input_event {
     struct input_hotplug_event hotplug_event;
     struct input_button_event button_event;
     struct input_analog_motion_event analog_motion_event;
+    struct input_state_event state_event;
+    struct input_ir_event ir_event;
+    struct input_pose_event pose_event;
   };
   struct timeval ts;
 };
@@ -125,7 +196,61 @@ struct input_source {
   bool (*poll_event)(struct input_event *event);
 };
 
+// IR objects only come from IR and state events, the pointer model is off
+extern bool input_raw_ir;
+
+// Interpolates the pointer model from a lookup table over the whole pointer
+// range instead of projecting the sensor bar for every position
+void input_use_ir_table(void);
+
+// Smooths the pointer with a One Euro filter (cutoff in Hz while still, its
+// increase per screen width/second of speed, and the cutoff of the speed
+// estimate) and extrapolates it lead seconds past the time each report is
+// built
+void input_use_pointer_filter(double min_cutoff, double beta,
+                              double speed_cutoff, double lead);
+
+// Interpolates the accelerometer, nunchuk stick, MotionPlus and IR objects
+// that producers send between their last two samples, at delay seconds
+// before each report is built and at most max_extrapolation seconds past the
+// newest sample
+void input_use_interpolation(double delay, double max_extrapolation);
+
+// pointer samples filtered and the time spent filtering, and the summed
+// distance (in screen widths) from each sample to the estimate before it,
+// extrapolated and not
+extern uint64_t input_filter_samples;
+extern uint64_t input_filter_ns;
+extern double input_prediction_error;
+extern double input_filtered_error;
+
+// absolute IR and accelerometer samples replaced by a newer one before they
+// were applied
+extern uint64_t input_coalesced_events;
+
+// enum input_state_field bits of the state an event changes
+uint16_t input_event_fields(struct input_event const *event);
+
 int input_update(struct wiimote_state *state,
                  struct input_source const *source);
 
+typedef void (*input_clock)(struct timeval *now);
+
+// Takes the time input_update and input_prepare_report work with from clock
+// instead of gettimeofday (NULL), so a source can run them on its own time
+// base. Returns the clock it replaces.
+input_clock input_use_clock(input_clock clock);
+
+// data reports sent so far, counted by input_report_sent, and the turns a
+// data report had whether or not it was sent, counted by input_report_turn
+extern uint64_t input_reports_sent;
+extern uint64_t input_report_turns;
+
+// Brings the state derived at report time (MotionPlus rates) up to date
+// before a report is generated, input_report_sent after a data report and
+// input_report_turn after every turn of one
+void input_prepare_report(struct wiimote_state *state);
+void input_report_sent(void);
+void input_report_turn(void);
+
 #endif
@@ -0,0 +1,415 @@
+/* linux/input.h has its own struct input_event, keep it out of our way */
+#define input_event linux_input_event
+#include <linux/input.h>
+#undef input_event
+
+#include "input_evdev.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROGRAM_NAME "wmemulator"
+
+#define EVDEV_DEVICES 8
+#define EVDEV_READ 64    /* kernel events read with one read call */
+#define EVDEV_PENDING 8  /* emulator events one kernel event can turn into */
+
+/* same calibration as motion.c */
+static const uint16_t accelerometer_zero = 0x85 << 2;
+static const uint16_t accelerometer_unit = 0x6C;
+
+enum evdev_mapping_kind {
+  MAPPING_BUTTON,
+  MAPPING_MOTION,
+  MAPPING_CONTROL,
+};
+
+struct evdev_mapping {
+  uint16_t code;
+  uint8_t kind;
+  uint8_t target; /* enum input_button, input_analog_motion or
+                     input_emulator_control depending on kind */
+};
+
+/* Keys and buttons, the keyboard part follows the SDL window's default
+ * layout */
+static struct evdev_mapping const mappings[] = {
+    {KEY_A, MAPPING_BUTTON, INPUT_BUTTON_WIIMOTE_A},
+    {KEY_D, MAPPING_BUTTON, INPUT_BUTTON_WIIMOTE_B},
+    {KEY_Q, MAPPING_BUTTON, INPUT_BUTTON_NUNCHUK_C},
+    {KEY_E, MAPPING_BUTTON, INPUT_BUTTON_NUNCHUK_Z},
+    {KEY_1, MAPPING_BUTTON, INPUT_BUTTON_WIIMOTE_1},
+    {KEY_2, MAPPING_BUTTON, INPUT_BUTTON_WIIMOTE_2},
+    {KEY_3, MAPPING_BUTTON, INPUT_BUTTON_WIIMOTE_MINUS},
+    {KEY_4, MAPPING_BUTTON, INPUT_BUTTON_WIIMOTE_PLUS},
+    {KEY_H, MAPPING_BUTTON, INPUT_BUTTON_HOME},
+    {KEY_KP8, MAPPING_BUTTON, INPUT_BUTTON_WIIMOTE_UP},
+    {KEY_KP2, MAPPING_BUTTON, INPUT_BUTTON_WIIMOTE_DOWN},
+    {KEY_KP4, MAPPING_BUTTON, INPUT_BUTTON_WIIMOTE_LEFT},
+    {KEY_KP6, MAPPING_BUTTON, INPUT_BUTTON_WIIMOTE_RIGHT},
+    {KEY_UP, MAPPING_MOTION, INPUT_ANALOG_MOTION_IR_UP},
+    {KEY_DOWN, MAPPING_MOTION, INPUT_ANALOG_MOTION_IR_DOWN},
+    {KEY_LEFT, MAPPING_MOTION, INPUT_ANALOG_MOTION_IR_LEFT},
+    {KEY_RIGHT, MAPPING_MOTION, INPUT_ANALOG_MOTION_IR_RIGHT},
+    {KEY_T, MAPPING_MOTION, INPUT_ANALOG_MOTION_STEER_LEFT},
+    {KEY_Y, MAPPING_MOTION, INPUT_ANALOG_MOTION_STEER_RIGHT},
+    {KEY_ESC, MAPPING_CONTROL, INPUT_EMULATOR_CONTROL_QUIT},
+
+    {BTN_SOUTH, MAPPING_BUTTON, INPUT_BUTTON_WIIMOTE_A},
+    {BTN_EAST, MAPPING_BUTTON, INPUT_BUTTON_WIIMOTE_B},
+    {BTN_WEST, MAPPING_BUTTON, INPUT_BUTTON_WIIMOTE_1},
+    {BTN_NORTH, MAPPING_BUTTON, INPUT_BUTTON_WIIMOTE_2},
+    {BTN_SELECT, MAPPING_BUTTON, INPUT_BUTTON_WIIMOTE_MINUS},
+    {BTN_START, MAPPING_BUTTON, INPUT_BUTTON_WIIMOTE_PLUS},
+    {BTN_MODE, MAPPING_BUTTON, INPUT_BUTTON_HOME},
+    {BTN_TL, MAPPING_BUTTON, INPUT_BUTTON_NUNCHUK_Z},
+    {BTN_TR, MAPPING_BUTTON, INPUT_BUTTON_NUNCHUK_C},
+    {BTN_DPAD_UP, MAPPING_BUTTON, INPUT_BUTTON_WIIMOTE_UP},
+    {BTN_DPAD_DOWN, MAPPING_BUTTON, INPUT_BUTTON_WIIMOTE_DOWN},
+    {BTN_DPAD_LEFT, MAPPING_BUTTON, INPUT_BUTTON_WIIMOTE_LEFT},
+    {BTN_DPAD_RIGHT, MAPPING_BUTTON, INPUT_BUTTON_WIIMOTE_RIGHT},
+};
+
+/* Axes collected until SYN_REPORT, then sent as one event each */
+enum evdev_dirty {
+  DIRTY_POINTER = 1 << 0, /* gamepad ABS_X/ABS_Y */
+  DIRTY_ACCEL = 1 << 1,   /* accelerometer ABS_X/Y/Z */
+  DIRTY_GYRO = 1 << 2,    /* accelerometer ABS_RX/RY/RZ */
+};
+
+struct evdev_device {
+  int fd;
+  bool accelerometer; /* INPUT_PROP_ACCELEROMETER, an IMU */
+  bool dropped;       /* SYN_DROPPED, ignore events up to SYN_REPORT */
+  bool read_done;     /* read returned short, nothing left this run */
+  uint8_t dirty;
+  int hat_x, hat_y;
+  struct input_absinfo abs[ABS_CNT];
+
+  int len, next;
+  struct linux_input_event buf[EVDEV_READ];
+};
+
+static struct evdev_device devices[EVDEV_DEVICES];
+static int device_count;
+static int current_device;
+
+static struct input_event pending[EVDEV_PENDING];
+static int pending_len, pending_next;
+
+static struct input_event *push_event(struct linux_input_event const *ev,
+                                      enum input_event_type type) {
+  if (pending_len == EVDEV_PENDING) {
+    return NULL;
+  }
+  struct input_event *event = &pending[pending_len++];
+  memset(event, 0, sizeof *event);
+  event->type = type;
+  /* kernel time, set to CLOCK_REALTIME so it matches gettimeofday */
+  event->ts.tv_sec = ev->input_event_sec;
+  event->ts.tv_usec = ev->input_event_usec;
+  return event;
+}
+
+static void push_button(struct linux_input_event const *ev,
+                        enum input_button button, bool pressed) {
+  struct input_event *event = push_event(ev, INPUT_EVENT_TYPE_BUTTON);
+  if (event) {
+    event->button_event.button = button;
+    event->button_event.pressed = pressed;
+  }
+}
+
+static void handle_key(struct linux_input_event const *ev) {
+  /* 2 is autorepeat */
+  if (ev->value == 2) {
+    return;
+  }
+
+  for (size_t i = 0; i < sizeof mappings / sizeof *mappings; i++) {
+    struct evdev_mapping const *mapping = &mappings[i];
+    if (mapping->code != ev->code) {
+      continue;
+    }
+
+    struct input_event *event;
+    switch (mapping->kind) {
+    case MAPPING_BUTTON:
+      push_button(ev, mapping->target, ev->value);
+      break;
+    case MAPPING_MOTION:
+      event = push_event(ev, INPUT_EVENT_TYPE_ANALOG_MOTION);
+      if (event) {
+        event->analog_motion_event.motion = mapping->target;
+        event->analog_motion_event.moving = ev->value;
+      }
+      break;
+    case MAPPING_CONTROL:
+      if (ev->value) {
+        event = push_event(ev, INPUT_EVENT_TYPE_EMULATOR_CONTROL);
+        if (event) {
+          event->emulator_control_event.control = mapping->target;
+        }
+      }
+      break;
+    }
+    return;
+  }
+}
+
+/* A hat axis is two buttons, release the old direction and press the new */
+static void handle_hat(struct linux_input_event const *ev, int *last,
+                       enum input_button negative, enum input_button positive) {
+  int value = ev->value < 0 ? -1 : ev->value > 0 ? 1 : 0;
+  if (value == *last) {
+    return;
+  }
+  if (*last) {
+    push_button(ev, *last < 0 ? negative : positive, false);
+  }
+  if (value) {
+    push_button(ev, value < 0 ? negative : positive, true);
+  }
+  *last = value;
+}
+
+static void handle_abs(struct evdev_device *device,
+                       struct linux_input_event const *ev) {
+  if (ev->code >= ABS_CNT) {
+    return;
+  }
+  device->abs[ev->code].value = ev->value;
+
+  switch (ev->code) {
+  case ABS_HAT0X:
+    handle_hat(ev, &device->hat_x, INPUT_BUTTON_WIIMOTE_LEFT,
+               INPUT_BUTTON_WIIMOTE_RIGHT);
+    break;
+  case ABS_HAT0Y:
+    handle_hat(ev, &device->hat_y, INPUT_BUTTON_WIIMOTE_UP,
+               INPUT_BUTTON_WIIMOTE_DOWN);
+    break;
+  case ABS_X:
+  case ABS_Y:
+  case ABS_Z:
+    if (device->accelerometer) {
+      device->dirty |= DIRTY_ACCEL;
+    } else if (ev->code != ABS_Z) {
+      device->dirty |= DIRTY_POINTER;
+    }
+    break;
+  case ABS_RX:
+  case ABS_RY:
+  case ABS_RZ:
+    if (device->accelerometer) {
+      device->dirty |= DIRTY_GYRO;
+    }
+    break;
+  }
+}
+
+static float abs_fraction(struct input_absinfo const *abs) {
+  if (abs->maximum == abs->minimum) {
+    return 0.5;
+  }
+  return (float)(abs->value - abs->minimum) / (abs->maximum - abs->minimum);
+}
+
+/* resolution is units per g for accelerometer axes */
+static uint16_t abs_accel(struct input_absinfo const *abs) {
+  float g = abs->resolution ? (float)abs->value / abs->resolution : 0;
+  int value = accelerometer_zero + (int)(accelerometer_unit * g);
+  return value < 0 ? 0 : value > 0x3FF ? 0x3FF : value;
+}
+
+/* resolution is units per degree/second for gyroscope axes */
+static float abs_rate(struct input_absinfo const *abs) {
+  return abs->resolution ? (float)abs->value / abs->resolution : 0;
+}
+
+static void handle_report(struct evdev_device *device,
+                          struct linux_input_event const *ev) {
+  struct input_event *event;
+  struct input_absinfo const *abs = device->abs;
+
+  if (device->dirty & DIRTY_POINTER) {
+    event = push_event(ev, INPUT_EVENT_TYPE_ANALOG_MOTION);
+    if (event) {
+      event->analog_motion_event.motion = INPUT_ANALOG_MOTION_IR_RAW;
+      event->analog_motion_event.x = abs_fraction(&abs[ABS_X]);
+      event->analog_motion_event.y = 1 - abs_fraction(&abs[ABS_Y]);
+    }
+  }
+
+  if (device->dirty & DIRTY_ACCEL) {
+    event = push_event(ev, INPUT_EVENT_TYPE_ANALOG_MOTION);
+    if (event) {
+      event->analog_motion_event.motion = INPUT_ANALOG_MOTION_ACCEL;
+      event->analog_motion_event.x = abs_accel(&abs[ABS_X]);
+      event->analog_motion_event.y = abs_accel(&abs[ABS_Y]);
+      event->analog_motion_event.z = abs_accel(&abs[ABS_Z]);
+    }
+  }
+
+  if (device->dirty & DIRTY_GYRO) {
+    event = push_event(ev, INPUT_EVENT_TYPE_STATE);
+    if (event) {
+      event->state_event.fields = INPUT_STATE_MOTIONPLUS;
+      event->state_event.motionplus_pitch = abs_rate(&abs[ABS_RX]);
+      event->state_event.motionplus_roll = abs_rate(&abs[ABS_RY]);
+      event->state_event.motionplus_yaw = abs_rate(&abs[ABS_RZ]);
+    }
+  }
+
+  device->dirty = 0;
+}
+
+/* Fetches every axis again after the kernel dropped events */
+static void resync_abs(struct evdev_device *device) {
+  for (int axis = 0; axis < ABS_CNT; axis++) {
+    if (device->abs[axis].maximum != device->abs[axis].minimum) {
+      ioctl(device->fd, EVIOCGABS(axis), &device->abs[axis]);
+    }
+  }
+  device->dirty = device->accelerometer ? DIRTY_ACCEL | DIRTY_GYRO
+                                        : DIRTY_POINTER;
+}
+
+static void handle_event(struct evdev_device *device,
+                         struct linux_input_event const *ev) {
+  if (ev->type == EV_SYN && ev->code == SYN_DROPPED) {
+    device->dropped = true;
+    return;
+  }
+  if (device->dropped) {
+    if (ev->type == EV_SYN && ev->code == SYN_REPORT) {
+      device->dropped = false;
+      resync_abs(device);
+      handle_report(device, ev);
+    }
+    return;
+  }
+
+  switch (ev->type) {
+  case EV_KEY:
+    handle_key(ev);
+    break;
+  case EV_ABS:
+    handle_abs(device, ev);
+    break;
+  case EV_SYN:
+    if (ev->code == SYN_REPORT) {
+      handle_report(device, ev);
+    }
+    break;
+  }
+}
+
+static void open_device(char const *path, bool grab) {
+  if (device_count == EVDEV_DEVICES) {
+    printf(PROGRAM_NAME ": fatal: more than %d input devices\n",
+           EVDEV_DEVICES);
+    exit(1);
+  }
+
+  struct evdev_device *device = &devices[device_count++];
+  memset(device, 0, sizeof *device);
+  device->fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (device->fd == -1) {
+    printf(PROGRAM_NAME ": can't open %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+
+  if (grab && ioctl(device->fd, EVIOCGRAB, 1)) {
+    printf(PROGRAM_NAME ": can't grab %s: %s\n", path, strerror(errno));
+    exit(1);
+  }
+
+  int clock = CLOCK_REALTIME;
+  ioctl(device->fd, EVIOCSCLOCKID, &clock);
+
+  unsigned long props = 0;
+  ioctl(device->fd, EVIOCGPROP(sizeof props), &props);
+  device->accelerometer = props & (1UL << INPUT_PROP_ACCELEROMETER);
+
+  for (int axis = 0; axis < ABS_CNT; axis++) {
+    ioctl(device->fd, EVIOCGABS(axis), &device->abs[axis]);
+  }
+
+  char name[128] = "unknown";
+  ioctl(device->fd, EVIOCGNAME(sizeof name), name);
+  printf(PROGRAM_NAME ": reading input from %s (%s%s)\n", path, name,
+         device->accelerometer ? ", accelerometer" : "");
+}
+
+void input_evdev_init(char const *paths, bool grab) {
+  char list[1024];
+  strncpy(list, paths, sizeof list - 1);
+  list[sizeof list - 1] = '\0';
+
+  char *save;
+  for (char *path = strtok_r(list, ",", &save); path;
+       path = strtok_r(NULL, ",", &save)) {
+    open_device(path, grab);
+  }
+}
+
+static void input_evdev_unload(void) {
+  for (int i = 0; i < device_count; i++) {
+    if (devices[i].fd != -1) {
+      close(devices[i].fd);
+    }
+  }
+}
+
+static bool input_evdev_poll_event(struct input_event *event) {
+  while (pending_next == pending_len) {
+    pending_len = pending_next = 0;
+
+    if (current_device == device_count) {
+      /* every device is drained, start over on the next input_update */
+      for (int i = 0; i < device_count; i++) {
+        devices[i].read_done = false;
+      }
+      current_device = 0;
+      return false;
+    }
+
+    struct evdev_device *device = &devices[current_device];
+    if (device->next < device->len) {
+      handle_event(device, &device->buf[device->next++]);
+      continue;
+    }
+    if (device->read_done || device->fd == -1) {
+      current_device++;
+      continue;
+    }
+
+    ssize_t ret = read(device->fd, device->buf, sizeof device->buf);
+    if (ret < 0) {
+      if (errno == ENODEV) {
+        printf(PROGRAM_NAME ": input device %d removed\n", current_device);
+        close(device->fd);
+        device->fd = -1;
+      } else if (errno != EAGAIN && errno != EINTR) {
+        perror(PROGRAM_NAME);
+      }
+      ret = 0;
+    }
+    device->len = ret / sizeof *device->buf;
+    device->next = 0;
+    /* a short read means the kernel queue is empty for now */
+    device->read_done = device->len < EVDEV_READ;
+  }
+
+  *event = pending[pending_next++];
+  return true;
+}
+
+struct input_source input_source_evdev = {.unload = input_evdev_unload,
+                                          .poll_event = input_evdev_poll_event};
@@ -0,0 +1,13 @@
+#ifndef INPUT_EVDEV_H
+#define INPUT_EVDEV_H
+
+#include <stdbool.h>
+#include "input.h"
+
+/* paths is a comma separated list of /dev/input/event* devices. With grab
+ * set, no other program receives their events while the emulator runs. */
+void input_evdev_init(char const *paths, bool grab);
+
+extern struct input_source input_source_evdev;
+
+#endif
@@ -7,5 +7,6 @@
 extern struct timeval pending_ir_ts;
 extern struct timeval pending_accel_ts;
 extern struct timeval pending_button_ts;
+extern struct timeval latest_input_ts;
 
 #endif // INPUT_LATENCY_H
@@ -0,0 +1,221 @@
+#include "input_script.h"
+#include "input_socket.h"
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#define PROGRAM_NAME "wmemulator"
+
+/* input clock step per report turn of a script timed in reports, the nominal
+ * report period */
+static const uint64_t report_period_us = 10000;
+
+/* where the input clock of a script timed in reports starts, the same on
+ * every run so replays compute the same intervals; a zero time means unset */
+static const struct timeval clock_base = {1, 0};
+
+/* A script entry parsed into the event it plays */
+struct script_event {
+  uint32_t at;
+  struct input_event event;
+};
+
+static struct script_event *events;
+static size_t event_count;
+static enum input_script_timing timing;
+static uint64_t length;
+static unsigned loops;
+static double speed;
+
+/* playback position: next event, the start of the current pass and where
+ * the script started */
+static size_t next_event;
+static uint64_t pass_start;
+static bool finished;
+static bool started;
+static struct timespec start_time;
+static uint64_t start_turn;
+static input_clock previous_clock;
+
+uint64_t input_script_events;
+uint64_t input_script_passes;
+bool input_script_own_clock = false;
+
+static void fail(char const *path, char const *problem) {
+  printf(PROGRAM_NAME ": script %s: %s\n", path, problem);
+  exit(1);
+}
+
+/* Walks the entries after the header, parsing them into out when it's set,
+ * and returns how many there are */
+static size_t read_entries(char const *path, char *data, size_t size,
+                           struct script_event *out) {
+  size_t count = 0, pos = sizeof(struct input_script_header);
+  uint32_t last_at = 0;
+
+  while (pos < size) {
+    struct input_script_entry entry;
+    if (size - pos < sizeof entry) {
+      fail(path, "truncated entry");
+    }
+    memcpy(&entry, data + pos, sizeof entry);
+    pos += sizeof entry;
+
+    uint32_t at = ntohl(entry.at);
+    uint16_t packet_size = ntohs(entry.size);
+    if (packet_size == 0 || size - pos < packet_size) {
+      fail(path, "truncated entry");
+    }
+    if (at < last_at) {
+      fail(path, "entries out of order");
+    }
+
+    if (out) {
+      out[count].at = at;
+      if (!input_socket_parse_packet(data + pos, packet_size,
+                                     &out[count].event)) {
+        printf(PROGRAM_NAME ": script %s: invalid packet in entry %zu\n",
+               path, count);
+        exit(1);
+      }
+      memset(&out[count].event.ts, 0, sizeof(out[count].event.ts));
+    }
+
+    last_at = at;
+    pos += packet_size;
+    count++;
+  }
+
+  return count;
+}
+
+/* The input clock of scripts timed in reports */
+static void script_clock(struct timeval *now) {
+  uint64_t elapsed_us = (input_report_turns - start_turn) * report_period_us;
+  struct timeval elapsed = {elapsed_us / 1000000, elapsed_us % 1000000};
+
+  timeradd(&clock_base, &elapsed, now);
+}
+
+void input_script_init(char const *path, unsigned loop_count,
+                       double speed_factor) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    perror(PROGRAM_NAME ": fopen");
+    exit(1);
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+
+  char *data = malloc(size > 0 ? size : 1);
+  if (size < (long)sizeof(struct input_script_header) ||
+      fread(data, 1, size, file) != (size_t)size) {
+    fail(path, "can't read header");
+  }
+  fclose(file);
+
+  struct input_script_header header;
+  memcpy(&header, data, sizeof header);
+  if (ntohl(header.magic) != INPUT_SCRIPT_MAGIC ||
+      header.version != INPUT_SCRIPT_VERSION) {
+    fail(path, "not a version 1 script");
+  }
+  if (header.timing != INPUT_SCRIPT_REPORTS &&
+      header.timing != INPUT_SCRIPT_MICROSECONDS) {
+    fail(path, "unknown timing");
+  }
+  if (speed_factor <= 0) {
+    fail(path, "speed must be positive");
+  }
+
+  /* everything is parsed here, playing the script only copies events */
+  event_count = read_entries(path, data, size, NULL);
+  if (event_count == 0) {
+    fail(path, "no entries");
+  }
+  events = malloc(event_count * sizeof *events);
+  read_entries(path, data, size, events);
+  free(data);
+
+  uint64_t end = (uint64_t)events[event_count - 1].at + 1;
+  length = ntohl(header.length);
+  if (length == 0) {
+    length = end;
+  } else if (length < end) {
+    fail(path, "entries past the length of the timeline");
+  }
+
+  timing = header.timing;
+  loops = loop_count;
+  speed = speed_factor;
+  next_event = 0;
+  pass_start = 0;
+  finished = false;
+  started = false;
+
+  if (timing == INPUT_SCRIPT_REPORTS) {
+    start_turn = input_report_turns;
+    previous_clock = input_use_clock(script_clock);
+    input_script_own_clock = true;
+  }
+
+  printf(PROGRAM_NAME ": playing %zu events from %s, timed in %s\n",
+         event_count, path,
+         timing == INPUT_SCRIPT_REPORTS ? "reports" : "microseconds");
+}
+
+static void input_script_unload(void) {
+  free(events);
+  events = NULL;
+  if (timing == INPUT_SCRIPT_REPORTS) {
+    input_use_clock(previous_clock);
+    input_script_own_clock = false;
+  }
+}
+
+/* Where playback is, in the script's units */
+static double script_position(void) {
+  if (timing == INPUT_SCRIPT_REPORTS) {
+    return (input_report_turns - start_turn) * speed;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (!started) {
+    start_time = now;
+    started = true;
+  }
+  return ((now.tv_sec - start_time.tv_sec) * 1000000.0 +
+          (now.tv_nsec - start_time.tv_nsec) / 1000.0) *
+         speed;
+}
+
+static bool input_script_poll_event(struct input_event *event) {
+  if (finished) {
+    return false;
+  }
+
+  struct script_event const *next = &events[next_event];
+  if (pass_start + next->at > script_position()) {
+    return false;
+  }
+
+  /* input_update stamps it with the input clock */
+  *event = next->event;
+  input_script_events++;
+
+  if (++next_event == event_count) {
+    next_event = 0;
+    pass_start += length;
+    input_script_passes++;
+    finished = loops && input_script_passes == loops;
+  }
+  return true;
+}
+
+struct input_source input_source_script = {
+    .unload = input_script_unload, .poll_event = input_script_poll_event};
@@ -0,0 +1,51 @@
+#ifndef INPUT_SCRIPT_H
+#define INPUT_SCRIPT_H
+
+#include <stdint.h>
+#include "input.h"
+
+#define INPUT_SCRIPT_MAGIC 0x574d5343 /* "WMSC" */
+#define INPUT_SCRIPT_VERSION 1
+
+/* What the entry times of a script count */
+enum input_script_timing {
+  INPUT_SCRIPT_REPORTS = 0,      /* data report turns since the start */
+  INPUT_SCRIPT_MICROSECONDS = 1, /* time since the first poll */
+};
+
+/* A script file is this header followed by entries, multi-byte values are
+ * big endian. Each entry is a struct input_script_entry and size bytes of a
+ * packet as the socket sources take it (see docs/SocketActions.md): a binary
+ * packet without flags or a single text command. Entries are sorted by at.
+ * The timeline lasts length units, so a loop starts over at length; 0 ends
+ * it right after the last entry. */
+struct input_script_header {
+  uint32_t magic;  /* INPUT_SCRIPT_MAGIC */
+  uint8_t version; /* INPUT_SCRIPT_VERSION */
+  uint8_t timing;  /* enum input_script_timing */
+  uint16_t reserved;
+  uint32_t length;
+} __attribute__((packed));
+
+struct input_script_entry {
+  uint32_t at;
+  uint16_t size;
+} __attribute__((packed));
+
+/* Loads and parses the whole script, then plays it loops times (0 for ever)
+ * with its times divided by speed. Scripts timed in reports also drive the
+ * input clock, one report turn every 10 ms, so replays build the same
+ * reports. */
+void input_script_init(char const *path, unsigned loops, double speed);
+
+extern struct input_source input_source_script;
+
+/* events played and passes completed */
+extern uint64_t input_script_events;
+extern uint64_t input_script_passes;
+
+/* whether a script timed in reports drives the input clock, so input times
+ * don't compare with the wall clock */
+extern bool input_script_own_clock;
+
+#endif
@@ -0,0 +1,86 @@
+#include "input_shm.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define PROGRAM_NAME "wmemulator"
+
+static struct input_shm_ring *ring;
+static char shm_name[256];
+
+uint64_t input_shm_frames;
+
+void input_shm_init(char const *name) {
+  /* shm_open wants a single leading slash */
+  snprintf(shm_name, sizeof shm_name, "%s%s", name[0] == '/' ? "" : "/",
+           name);
+
+  shm_unlink(shm_name);
+  int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd == -1) {
+    perror(PROGRAM_NAME ": shm_open");
+    exit(1);
+  }
+
+  if (ftruncate(fd, sizeof *ring)) {
+    perror(PROGRAM_NAME ": ftruncate");
+    exit(1);
+  }
+
+  ring = mmap(NULL, sizeof *ring, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ring == MAP_FAILED) {
+    perror(PROGRAM_NAME ": mmap");
+    exit(1);
+  }
+
+  ring->slots = INPUT_SHM_SLOTS;
+  ring->head = ring->tail = 0;
+  __atomic_store_n(&ring->magic, INPUT_SHM_MAGIC, __ATOMIC_RELEASE);
+
+  printf(PROGRAM_NAME ": reading input from shared memory %s\n", shm_name);
+}
+
+static void input_shm_unload(void) {
+  munmap(ring, sizeof *ring);
+  shm_unlink(shm_name);
+}
+
+static bool input_shm_poll_event(struct input_event *event) {
+  uint32_t tail = ring->tail;
+
+  /* the fast path is plain memory access, no syscalls */
+  while (tail != __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+    struct input_socket_state_frame const *frame =
+        &ring->frame[tail % INPUT_SHM_SLOTS];
+    bool valid = frame->type == INPUT_SOCKET_PACKET_STATE &&
+                 frame->version == INPUT_SOCKET_STATE_VERSION;
+
+    if (valid) {
+      event->type = INPUT_EVENT_TYPE_STATE;
+      input_socket_parse_state_frame(frame, &event->state_event);
+    } else {
+      printf(PROGRAM_NAME
+             ": skipped shared memory frame of type %d version %d\n",
+             frame->type, frame->version);
+    }
+    /* the producer may reuse the slot from here on */
+    __atomic_store_n(&ring->tail, ++tail, __ATOMIC_RELEASE);
+
+    if (valid) {
+      gettimeofday(&event->ts, NULL);
+      input_shm_frames++;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+struct input_source input_source_shm = {.unload = input_shm_unload,
+                                        .poll_event = input_shm_poll_event};
@@ -0,0 +1,37 @@
+#ifndef INPUT_SHM_H
+#define INPUT_SHM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "input.h"
+#include "input_socket.h"
+
+#define INPUT_SHM_MAGIC 0x574d5348 /* "WMSH" */
+#define INPUT_SHM_SLOTS 256        /* power of two */
+
+/* Single producer, single consumer ring of state frames in POSIX shared
+ * memory. head and tail count frames and wrap at 2^32, the slot of frame n is
+ * n % INPUT_SHM_SLOTS. The producer fills frame[head % slots] while
+ * head - tail < slots, then stores head + 1 with release ordering. The
+ * emulator reads frames up to head and stores tail with release ordering.
+ * head and tail sit on their own cache lines so the two sides don't share
+ * one. */
+struct input_shm_ring {
+  uint32_t magic; /* INPUT_SHM_MAGIC, set by the emulator */
+  uint32_t slots; /* INPUT_SHM_SLOTS */
+
+  uint32_t head __attribute__((aligned(64))); /* written by the producer */
+  uint32_t tail __attribute__((aligned(64))); /* written by the emulator */
+
+  struct input_socket_state_frame frame[INPUT_SHM_SLOTS]
+      __attribute__((aligned(64)));
+};
+
+void input_shm_init(char const *name);
+
+extern struct input_source input_source_shm;
+
+/* frames read from the ring */
+extern uint64_t input_shm_frames;
+
+#endif
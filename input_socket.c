@@ -1,8 +1,13 @@
+#define _GNU_SOURCE
+
 #include "input_socket.h"
 #include "motion.h"
 #include "sys/time.h"
 #include <arpa/inet.h>
+#include <endian.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,10 +20,181 @@
 #define PROGRAM_NAME "wmemulator"
 
 static bool input_socket_init_from_addrinfo(struct addrinfo *addrinfo);
+static void init_socket(struct sockaddr *socket_address,
+                        socklen_t socket_address_size, int type);
+
+/* Datagrams received with one recvmmsg call */
+#define BATCH_SIZE 16
+#define DATAGRAM_SIZE 512
 
 static int sock;
-static char buf[512];
-static size_t buf_len;
+
+static char batch_buf[BATCH_SIZE][DATAGRAM_SIZE];
+static struct sockaddr_storage batch_addr[BATCH_SIZE];
+static struct iovec batch_iov[BATCH_SIZE];
+static struct mmsghdr batch_msg[BATCH_SIZE];
+static int batch_len;  /* datagrams in the current batch */
+static int batch_next; /* next datagram to parse */
+static bool batch_done; /* a short batch was handed out, the socket is empty */
+
+/* Text commands of the current datagram not parsed yet */
+static char const *text_next;
+static char const *text_end;
+static struct timeval text_ts;
+
+enum keyword_kind {
+  KEYWORD_NONE,
+  KEYWORD_TYPE,
+  KEYWORD_BUTTON,
+  KEYWORD_ANALOG_MOTION,
+  KEYWORD_EMULATOR_CONTROL,
+  KEYWORD_EXTENSION,
+};
+
+struct keyword {
+  char const *name;
+  uint8_t len;
+  uint8_t kind;
+  uint8_t value;
+};
+
+/* Every name of docs/SocketActions.md at the slot keyword_hash picks for it.
+ * KEYWORD_SEED was searched offline so that no two names share a slot; after
+ * adding a name, search for a new seed and recompute the slots. */
+#define KEYWORD_SEED 0x2b3
+#define KEYWORD(Slot, Name, Kind, Value)                                       \
+  [Slot] = {Name, sizeof(Name) - 1, Kind, Value}
+
+static struct keyword const keywords[256] = {
+    KEYWORD(237, "button", KEYWORD_TYPE, INPUT_EVENT_TYPE_BUTTON),
+    KEYWORD(40, "HOME", KEYWORD_BUTTON, INPUT_BUTTON_HOME),
+    KEYWORD(244, "WIIMOTE_UP", KEYWORD_BUTTON, INPUT_BUTTON_WIIMOTE_UP),
+    KEYWORD(200, "WIIMOTE_DOWN", KEYWORD_BUTTON, INPUT_BUTTON_WIIMOTE_DOWN),
+    KEYWORD(212, "WIIMOTE_LEFT", KEYWORD_BUTTON, INPUT_BUTTON_WIIMOTE_LEFT),
+    KEYWORD(161, "WIIMOTE_RIGHT", KEYWORD_BUTTON, INPUT_BUTTON_WIIMOTE_RIGHT),
+    KEYWORD(42, "WIIMOTE_A", KEYWORD_BUTTON, INPUT_BUTTON_WIIMOTE_A),
+    KEYWORD(39, "WIIMOTE_B", KEYWORD_BUTTON, INPUT_BUTTON_WIIMOTE_B),
+    KEYWORD(186, "WIIMOTE_1", KEYWORD_BUTTON, INPUT_BUTTON_WIIMOTE_1),
+    KEYWORD(183, "WIIMOTE_2", KEYWORD_BUTTON, INPUT_BUTTON_WIIMOTE_2),
+    KEYWORD(72, "WIIMOTE_PLUS", KEYWORD_BUTTON, INPUT_BUTTON_WIIMOTE_PLUS),
+    KEYWORD(249, "WIIMOTE_MINUS", KEYWORD_BUTTON, INPUT_BUTTON_WIIMOTE_MINUS),
+    KEYWORD(126, "NUNCHUK_C", KEYWORD_BUTTON, INPUT_BUTTON_NUNCHUK_C),
+    KEYWORD(149, "NUNCHUK_Z", KEYWORD_BUTTON, INPUT_BUTTON_NUNCHUK_Z),
+    KEYWORD(48, "CLASSIC_UP", KEYWORD_BUTTON, INPUT_BUTTON_CLASSIC_UP),
+    KEYWORD(86, "CLASSIC_DOWN", KEYWORD_BUTTON, INPUT_BUTTON_CLASSIC_DOWN),
+    KEYWORD(189, "CLASSIC_LEFT", KEYWORD_BUTTON, INPUT_BUTTON_CLASSIC_LEFT),
+    KEYWORD(193, "CLASSIC_RIGHT", KEYWORD_BUTTON, INPUT_BUTTON_CLASSIC_RIGHT),
+    KEYWORD(109, "CLASSIC_A", KEYWORD_BUTTON, INPUT_BUTTON_CLASSIC_A),
+    KEYWORD(106, "CLASSIC_B", KEYWORD_BUTTON, INPUT_BUTTON_CLASSIC_B),
+    KEYWORD(116, "CLASSIC_X", KEYWORD_BUTTON, INPUT_BUTTON_CLASSIC_X),
+    KEYWORD(117, "CLASSIC_Y", KEYWORD_BUTTON, INPUT_BUTTON_CLASSIC_Y),
+    KEYWORD(96, "CLASSIC_L", KEYWORD_BUTTON, INPUT_BUTTON_CLASSIC_L),
+    KEYWORD(122, "CLASSIC_R", KEYWORD_BUTTON, INPUT_BUTTON_CLASSIC_R),
+    KEYWORD(138, "CLASSIC_ZL", KEYWORD_BUTTON, INPUT_BUTTON_CLASSIC_ZL),
+    KEYWORD(136, "CLASSIC_ZR", KEYWORD_BUTTON, INPUT_BUTTON_CLASSIC_ZR),
+    KEYWORD(226, "CLASSIC_PLUS", KEYWORD_BUTTON, INPUT_BUTTON_CLASSIC_PLUS),
+    KEYWORD(12, "CLASSIC_MINUS", KEYWORD_BUTTON, INPUT_BUTTON_CLASSIC_MINUS),
+    KEYWORD(107, "analog_motion", KEYWORD_TYPE, INPUT_EVENT_TYPE_ANALOG_MOTION),
+    KEYWORD(44, "IR_UP", KEYWORD_ANALOG_MOTION, INPUT_ANALOG_MOTION_IR_UP),
+    KEYWORD(241, "IR_DOWN", KEYWORD_ANALOG_MOTION, INPUT_ANALOG_MOTION_IR_DOWN),
+    KEYWORD(168, "IR_LEFT", KEYWORD_ANALOG_MOTION, INPUT_ANALOG_MOTION_IR_LEFT),
+    KEYWORD(31, "IR_RIGHT", KEYWORD_ANALOG_MOTION, INPUT_ANALOG_MOTION_IR_RIGHT),
+    KEYWORD(121, "STEER_LEFT", KEYWORD_ANALOG_MOTION, INPUT_ANALOG_MOTION_STEER_LEFT),
+    KEYWORD(162, "STEER_RIGHT", KEYWORD_ANALOG_MOTION, INPUT_ANALOG_MOTION_STEER_RIGHT),
+    KEYWORD(165, "NUNCHUK_UP", KEYWORD_ANALOG_MOTION, INPUT_ANALOG_MOTION_NUNCHUK_UP),
+    KEYWORD(5, "NUNCHUK_DOWN", KEYWORD_ANALOG_MOTION, INPUT_ANALOG_MOTION_NUNCHUK_DOWN),
+    KEYWORD(130, "NUNCHUK_LEFT", KEYWORD_ANALOG_MOTION, INPUT_ANALOG_MOTION_NUNCHUK_LEFT),
+    KEYWORD(179, "NUNCHUK_RIGHT", KEYWORD_ANALOG_MOTION, INPUT_ANALOG_MOTION_NUNCHUK_RIGHT),
+    KEYWORD(120, "CLASSIC_LEFT_STICK_UP", KEYWORD_ANALOG_MOTION, INPUT_ANALOG_MOTION_CLASSIC_LEFT_STICK_UP),
+    KEYWORD(205, "CLASSIC_LEFT_STICK_DOWN", KEYWORD_ANALOG_MOTION, INPUT_ANALOG_MOTION_CLASSIC_LEFT_STICK_DOWN),
+    KEYWORD(13, "CLASSIC_LEFT_STICK_LEFT", KEYWORD_ANALOG_MOTION, INPUT_ANALOG_MOTION_CLASSIC_LEFT_STICK_LEFT),
+    KEYWORD(99, "CLASSIC_LEFT_STICK_RIGHT", KEYWORD_ANALOG_MOTION, INPUT_ANALOG_MOTION_CLASSIC_LEFT_STICK_RIGHT),
+    KEYWORD(1, "MOTIONPLUS_UP", KEYWORD_ANALOG_MOTION, INPUT_ANALOG_MOTION_MOTIONPLUS_UP),
+    KEYWORD(108, "MOTIONPLUS_DOWN", KEYWORD_ANALOG_MOTION, INPUT_ANALOG_MOTION_MOTIONPLUS_DOWN),
+    KEYWORD(148, "MOTIONPLUS_LEFT", KEYWORD_ANALOG_MOTION, INPUT_ANALOG_MOTION_MOTIONPLUS_LEFT),
+    KEYWORD(119, "MOTIONPLUS_RIGHT", KEYWORD_ANALOG_MOTION, INPUT_ANALOG_MOTION_MOTIONPLUS_RIGHT),
+    KEYWORD(68, "MOTIONPLUS_SLOW", KEYWORD_ANALOG_MOTION, INPUT_ANALOG_MOTION_MOTIONPLUS_SLOW),
+    KEYWORD(133, "emulator_control", KEYWORD_TYPE, INPUT_EVENT_TYPE_EMULATOR_CONTROL),
+    KEYWORD(146, "quit", KEYWORD_EMULATOR_CONTROL, INPUT_EMULATOR_CONTROL_QUIT),
+    KEYWORD(135, "power_off", KEYWORD_EMULATOR_CONTROL, INPUT_EMULATOR_CONTROL_POWER_OFF),
+    KEYWORD(7, "hotplug", KEYWORD_TYPE, INPUT_EVENT_TYPE_HOTPLUG),
+    KEYWORD(115, "nunchuk", KEYWORD_EXTENSION, Nunchuk),
+    KEYWORD(158, "classic", KEYWORD_EXTENSION, Classic),
+    KEYWORD(172, "balance_board", KEYWORD_EXTENSION, BalanceBoard),
+    KEYWORD(16, "none", KEYWORD_EXTENSION, NoExtension),
+};
+
+#undef KEYWORD
+
+/* Offset between a sender's capture clock and ours, estimated from
+ * ping/pong round trips. The sample with the shortest round trip of the
+ * last CLOCK_SAMPLES is the least disturbed by queueing, so it is used. */
+#define CLOCK_SAMPLES 8
+#define PING_INTERVAL_US 1000000
+
+struct clock_sync {
+  bool stamped;       /* the sender sends capture times */
+  int64_t last_ping;  /* our time of the last ping */
+  int samples;
+  int next_sample;
+  int64_t offset[CLOCK_SAMPLES]; /* sender clock minus ours */
+  int64_t round_trip[CLOCK_SAMPLES];
+};
+
+uint64_t input_socket_stamped;
+uint64_t input_socket_pongs;
+
+/* Stream server: every message is a 16 bit big endian length followed by a
+ * payload in the datagram format */
+#define STREAM_CLIENTS 8
+#define STREAM_BUFFER_SIZE 4096
+#define STREAM_BUDGET 32 /* messages per client per input_update */
+
+struct stream_client {
+  int fd;
+  struct clock_sync clock;
+  uint16_t owned; /* enum input_state_field bits this client controls */
+  int budget;
+  size_t len; /* bytes in buf */
+  size_t pos; /* start of the next message */
+  char buf[STREAM_BUFFER_SIZE];
+};
+
+static struct stream_client clients[STREAM_CLIENTS];
+static int client_count;
+static int next_client;         /* round robin position */
+static int text_client = -1;    /* client the text cursor belongs to */
+static uint16_t owned_fields;   /* union of the clients' owned fields */
+static bool tick_started;
+
+uint64_t input_socket_refused;
+
+/* Datagram senders whose sequence numbers are tracked, one per binary
+ * packet type. The least recently heard sender is replaced when full. */
+#define PEERS 16
+#define PEER_CHANNELS INPUT_SOCKET_PACKET_POSE
+/* a step back this large is a restarted sender rather than a late packet */
+#define SEQ_RESTART 1024
+
+struct peer {
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  uint64_t heard; /* peer_clock when last heard */
+  bool has_seq[PEER_CHANNELS];
+  uint32_t seq[PEER_CHANNELS];
+  struct clock_sync clock;
+};
+
+static struct peer peers[PEERS];
+static uint64_t peer_clock;
+
+uint64_t input_socket_lost;
+uint64_t input_socket_reordered;
+uint64_t input_socket_duplicates;
+
+uint64_t input_socket_syscalls;
+uint64_t input_socket_datagrams;
+uint64_t input_socket_events;
 
 /* Helper function to convert a 32-bit network order float to host float */
 static float ntohf(uint32_t net) {
@@ -28,18 +204,241 @@ static float ntohf(uint32_t net) {
   return f;
 }
 
-void input_socket_init_unix_at_path(char const *path) {
+void input_socket_parse_state_frame(
+    struct input_socket_state_frame const *frame,
+    struct input_state_event *event) {
+  event->fields = ntohs(frame->fields);
+  event->seq = ntohl(frame->seq);
+  event->buttons = ntohl(frame->buttons);
+
+  event->accel_x = ntohs(frame->accel[0]);
+  event->accel_y = ntohs(frame->accel[1]);
+  event->accel_z = ntohs(frame->accel[2]);
+
+  for (int i = 0; i < 4; i++) {
+    reset_ir_object(&event->ir_object[i]);
+    if (frame->ir[i].x == 0xffff && frame->ir[i].y == 0xffff) {
+      continue;
+    }
+    event->ir_object[i].x = ntohs(frame->ir[i].x);
+    event->ir_object[i].y = ntohs(frame->ir[i].y);
+    event->ir_object[i].size = frame->ir[i].size;
+  }
+
+  event->nunchuk_x = frame->nunchuk_x;
+  event->nunchuk_y = frame->nunchuk_y;
+  event->nunchuk_accel_x = ntohs(frame->nunchuk_accel[0]);
+  event->nunchuk_accel_y = ntohs(frame->nunchuk_accel[1]);
+  event->nunchuk_accel_z = ntohs(frame->nunchuk_accel[2]);
+
+  event->classic_ls_x = frame->classic_ls_x;
+  event->classic_ls_y = frame->classic_ls_y;
+  event->classic_rs_x = frame->classic_rs_x;
+  event->classic_rs_y = frame->classic_rs_y;
+  event->classic_lt = frame->classic_lt;
+  event->classic_rt = frame->classic_rt;
+
+  event->motionplus_yaw = ntohf(frame->motionplus[0]);
+  event->motionplus_roll = ntohf(frame->motionplus[1]);
+  event->motionplus_pitch = ntohf(frame->motionplus[2]);
+}
+
+/* FNV-1a, the top byte is the slot in keywords */
+static uint8_t keyword_hash(char const *name, size_t len) {
+  uint32_t hash = KEYWORD_SEED;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (uint8_t)name[i]) * 0x01000193;
+  }
+  return hash >> 24;
+}
+
+static struct keyword const *lookup_keyword(char const *name, size_t len) {
+  struct keyword const *keyword = &keywords[keyword_hash(name, len)];
+  if (keyword->len != len || memcmp(keyword->name, name, len)) {
+    return NULL;
+  }
+  return keyword;
+}
+
+static void check_keywords(void) {
+  for (int i = 0; i < 256; i++) {
+    if (keywords[i].name &&
+        keyword_hash(keywords[i].name, keywords[i].len) != i) {
+      printf(PROGRAM_NAME ": fatal: keyword %s is in the wrong slot\n",
+             keywords[i].name);
+      exit(1);
+    }
+  }
+}
+
+static bool is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+/* Returns the length of the next token before end, 0 if there is none */
+static size_t next_token(char const **pos, char const *end,
+                         char const **token) {
+  char const *p = *pos;
+  while (p < end && is_blank(*p)) {
+    p++;
+  }
+  *token = p;
+  while (p < end && !is_blank(*p)) {
+    p++;
+  }
+  *pos = p;
+  return p - *token;
+}
+
+static bool parse_status(char const *token, size_t len, int *status) {
+  size_t i = 0;
+  bool negative = false;
+  if (len > 0 && (token[0] == '-' || token[0] == '+')) {
+    negative = token[0] == '-';
+    i++;
+  }
+  if (i == len) {
+    return false;
+  }
+
+  int value = 0;
+  for (; i < len; i++) {
+    if (token[i] < '0' || token[i] > '9') {
+      return false;
+    }
+    /* numbers that don't fit an int are as invalid as any other garbage */
+    int digit = token[i] - '0';
+    if (value > (INT_MAX - digit) / 10) {
+      return false;
+    }
+    value = value * 10 + digit;
+  }
+  *status = negative ? -value : value;
+  return true;
+}
+
+/* Parses the next line of the current text datagram into event */
+static bool parse_text_command(struct input_event *event) {
+  char const *line = text_next;
+  char const *line_end = memchr(line, '\n', text_end - line);
+  if (line_end) {
+    text_next = line_end + 1;
+  } else {
+    line_end = text_end;
+    text_next = text_end;
+  }
+
+  char const *type_s, *status_s, *param_s;
+  size_t type_len = next_token(&line, line_end, &type_s);
+  size_t status_len = next_token(&line, line_end, &status_s);
+  size_t param_len = next_token(&line, line_end, &param_s);
+  if (!type_len) {
+    return false;
+  }
+
+  int status;
+  if (!parse_status(status_s, status_len, &status)) {
+    printf(PROGRAM_NAME ": received input in invalid format\n");
+    return false;
+  }
+
+  struct keyword const *type = lookup_keyword(type_s, type_len);
+  struct keyword const *param = lookup_keyword(param_s, param_len);
+  if (!type || type->kind != KEYWORD_TYPE) {
+    printf(PROGRAM_NAME ": received invalid event type: %.*s\n", (int)type_len,
+           type_s);
+    return false;
+  }
+
+  event->type = type->value;
+  event->ts = text_ts;
+
+  switch (event->type) {
+  case INPUT_EVENT_TYPE_EMULATOR_CONTROL:
+    if (!param || param->kind != KEYWORD_EMULATOR_CONTROL) {
+      printf(PROGRAM_NAME
+             ": received invalid 'emulator_control' parameter: %.*s\n",
+             (int)param_len, param_s);
+      return false;
+    }
+    event->emulator_control_event.control = param->value;
+    break;
+  case INPUT_EVENT_TYPE_HOTPLUG:
+    if (status != 0 && param && param->kind == KEYWORD_EXTENSION) {
+      event->hotplug_event.extension = param->value;
+    } else {
+      event->hotplug_event.extension = NoExtension;
+    }
+    break;
+  case INPUT_EVENT_TYPE_BUTTON:
+    if (!param || param->kind != KEYWORD_BUTTON) {
+      printf(PROGRAM_NAME ": received invalid 'button' parameter: %.*s\n",
+             (int)param_len, param_s);
+      return false;
+    }
+    event->button_event.pressed = status;
+    event->button_event.button = param->value;
+    break;
+  case INPUT_EVENT_TYPE_ANALOG_MOTION:
+    if (!param || param->kind != KEYWORD_ANALOG_MOTION) {
+      printf(PROGRAM_NAME
+             ": received invalid 'analog_motion' parameter: %.*s\n",
+             (int)param_len, param_s);
+      return false;
+    }
+    event->analog_motion_event.moving = status;
+    event->analog_motion_event.motion = param->value;
+    break;
+  default:
+    return false;
+  }
+  return true;
+}
+
+static void init_batch(void) {
+  for (int i = 0; i < BATCH_SIZE; i++) {
+    batch_iov[i].iov_base = batch_buf[i];
+    batch_iov[i].iov_len = DATAGRAM_SIZE;
+    batch_msg[i].msg_hdr.msg_name = &batch_addr[i];
+    batch_msg[i].msg_hdr.msg_iov = &batch_iov[i];
+    batch_msg[i].msg_hdr.msg_iovlen = 1;
+  }
+  batch_len = batch_next = 0;
+  batch_done = false;
+}
+
+/* Refills the batch, returns false if there's nothing to read */
+static bool receive_batch(void) {
+  batch_len = batch_next = 0;
+  for (int i = 0; i < BATCH_SIZE; i++) {
+    batch_msg[i].msg_hdr.msg_namelen = sizeof batch_addr[i];
+  }
+
+  input_socket_syscalls++;
+  int ret = recvmmsg(sock, batch_msg, BATCH_SIZE, MSG_DONTWAIT, NULL);
+  if (ret == -1) {
+    if (!(errno == EAGAIN || errno == EWOULDBLOCK)) {
+      perror(PROGRAM_NAME);
+    }
+    return false;
+  }
+
+  batch_len = ret;
+  input_socket_datagrams += ret;
+  /* a full batch means more datagrams may be waiting */
+  batch_done = ret < BATCH_SIZE;
+  return ret > 0;
+}
+
+static void init_unix(char const *path, int type) {
   struct sockaddr_un address = {.sun_family = AF_UNIX};
   strncpy(address.sun_path, path, sizeof address.sun_path);
 
   unlink(path);
-  input_socket_init((struct sockaddr *)&address, sizeof address);
+  init_socket((struct sockaddr *)&address, sizeof address, type);
 }
 
-void input_socket_init_ip_on_port(char const *port) {
-  struct addrinfo hints = {.ai_family = AF_UNSPEC,
-                           .ai_socktype = SOCK_DGRAM,
-                           .ai_flags = AI_PASSIVE};
+static void init_ip(char const *port, int type) {
+  struct addrinfo hints = {
+      .ai_family = AF_UNSPEC, .ai_socktype = type, .ai_flags = AI_PASSIVE};
   struct addrinfo *result_info;
   int ret = getaddrinfo(NULL, port, &hints, &result_info);
   if (ret) {
@@ -50,6 +449,7 @@ void input_socket_init_ip_on_port(char const *port) {
   for (struct addrinfo *info = result_info; info; info = info->ai_next) {
     if (input_socket_init_from_addrinfo(info)) {
       freeaddrinfo(result_info);
+      check_keywords();
       printf(PROGRAM_NAME ": successfully bound to port %s\n", port);
       return;
     }
@@ -59,9 +459,9 @@ void input_socket_init_ip_on_port(char const *port) {
   exit(1);
 }
 
-void input_socket_init(struct sockaddr *socket_address,
-                       socklen_t socket_address_size) {
-  sock = socket(socket_address->sa_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+static void init_socket(struct sockaddr *socket_address,
+                        socklen_t socket_address_size, int type) {
+  sock = socket(socket_address->sa_family, type | SOCK_NONBLOCK, 0);
   if (sock == -1) {
     perror(PROGRAM_NAME);
     exit(1);
@@ -71,6 +471,35 @@ void input_socket_init(struct sockaddr *socket_address,
     perror(PROGRAM_NAME);
     exit(1);
   }
+
+  if (type == SOCK_STREAM && listen(sock, STREAM_CLIENTS)) {
+    perror(PROGRAM_NAME);
+    exit(1);
+  }
+
+  check_keywords();
+  init_batch();
+}
+
+void input_socket_init_unix_at_path(char const *path) {
+  init_unix(path, SOCK_DGRAM);
+}
+
+void input_socket_init_ip_on_port(char const *port) {
+  init_ip(port, SOCK_DGRAM);
+}
+
+void input_socket_init_stream_unix_at_path(char const *path) {
+  init_unix(path, SOCK_STREAM);
+}
+
+void input_socket_init_stream_ip_on_port(char const *port) {
+  init_ip(port, SOCK_STREAM);
+}
+
+void input_socket_init(struct sockaddr *socket_address,
+                       socklen_t socket_address_size) {
+  init_socket(socket_address, socket_address_size, SOCK_DGRAM);
 }
 
 static bool input_socket_init_from_addrinfo(struct addrinfo *addrinfo) {
@@ -80,11 +509,22 @@ static bool input_socket_init_from_addrinfo(struct addrinfo *addrinfo) {
     return false;
   }
 
+  if (addrinfo->ai_socktype == SOCK_STREAM) {
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+  }
+
   if (bind(sock, addrinfo->ai_addr, addrinfo->ai_addrlen)) {
     close(sock);
     return false;
   }
 
+  if (addrinfo->ai_socktype == SOCK_STREAM && listen(sock, STREAM_CLIENTS)) {
+    close(sock);
+    return false;
+  }
+
+  init_batch();
   return true;
 }
 
@@ -94,22 +534,193 @@ static void input_socket_unload(void) {
   }
 }
 
-static bool input_socket_poll_event(struct input_event *event) {
-  if (!buf_len) {
-    buf_len = recv(sock, buf, sizeof(buf), 0);
-    if (buf_len == -1) {
-      buf_len = 0;
-      if (!(errno == EAGAIN || errno == EWOULDBLOCK)) {
-        perror(PROGRAM_NAME);
+static int64_t now_us(void) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+static int64_t clock_offset(struct clock_sync const *clock) {
+  int best = 0;
+  for (int i = 1; i < clock->samples; i++) {
+    if (clock->round_trip[i] < clock->round_trip[best]) {
+      best = i;
+    }
+  }
+  return clock->offset[best];
+}
+
+/* sender_time was read by the sender between our ping at ping_time and
+ * now, assume it was halfway */
+static void add_clock_sample(struct clock_sync *clock, uint64_t ping_time,
+                             uint64_t sender_time) {
+  int64_t now = now_us();
+  int64_t round_trip = now - (int64_t)ping_time;
+  if (!clock || round_trip < 0 || round_trip > PING_INTERVAL_US) {
+    return;
+  }
+
+  int i = clock->next_sample;
+  clock->offset[i] = (int64_t)sender_time - ((int64_t)ping_time + now) / 2;
+  clock->round_trip[i] = round_trip;
+  clock->next_sample = (i + 1) % CLOCK_SAMPLES;
+  if (clock->samples < CLOCK_SAMPLES) {
+    clock->samples++;
+  }
+  input_socket_pongs++;
+}
+
+/* Fills ping with a ping packet when clock's sender is due one */
+static bool ping_due(struct clock_sync *clock, uint8_t ping[9]) {
+  if (!clock->stamped) {
+    return false;
+  }
+  int64_t now = now_us();
+  if (now - clock->last_ping < PING_INTERVAL_US) {
+    return false;
+  }
+  clock->last_ping = now;
+
+  uint64_t net_now = htobe64(now);
+  ping[0] = INPUT_SOCKET_PACKET_PING;
+  memcpy(ping + 1, &net_now, sizeof net_now);
+  return true;
+}
+
+static struct peer *find_peer(struct sockaddr const *addr,
+                              socklen_t addr_len) {
+  struct peer *oldest = &peers[0];
+  for (int i = 0; i < PEERS; i++) {
+    if (peers[i].addr_len == addr_len &&
+        memcmp(&peers[i].addr, addr, addr_len) == 0) {
+      peers[i].heard = ++peer_clock;
+      return &peers[i];
+    }
+    if (peers[i].heard < oldest->heard) {
+      oldest = &peers[i];
+    }
+  }
+
+  memset(oldest, 0, sizeof *oldest);
+  memcpy(&oldest->addr, addr, addr_len);
+  oldest->addr_len = addr_len;
+  oldest->heard = ++peer_clock;
+  return oldest;
+}
+
+/* Returns false if a packet of channel with seq is older than or the same as
+ * the last one accepted from peer */
+static bool check_sequence(struct peer *peer, int channel, uint32_t seq) {
+  int32_t step = seq - peer->seq[channel];
+
+  if (peer->has_seq[channel] && step <= 0 && step > -SEQ_RESTART) {
+    if (step == 0) {
+      input_socket_duplicates++;
+    } else {
+      /* it was counted as lost when the newer packet arrived */
+      input_socket_reordered++;
+      if (input_socket_lost) {
+        input_socket_lost--;
       }
+    }
+    return false;
+  }
+
+  if (peer->has_seq[channel] && step > 0) {
+    input_socket_lost += step - 1;
+  }
+  peer->has_seq[channel] = true;
+  peer->seq[channel] = seq;
+  return true;
+}
+
+static bool parse_packet(char *buf, size_t buf_len,
+                         struct input_event *event) {
+  /* Check for a binary pose packet, see struct input_socket_pose_frame */
+  if (buf_len >= sizeof(struct input_socket_pose_frame) &&
+      ((unsigned char)buf[0]) == INPUT_SOCKET_PACKET_POSE) {
+    struct input_socket_pose_frame frame;
+    memcpy(&frame, buf, sizeof(frame));
+
+    event->type = INPUT_EVENT_TYPE_POSE;
+    event->pose_event.fields = frame.fields;
+    /* sums of squares, a NaN or infinity in any part shows up in its sum */
+    float position = 0, rates = 0, norm = 0;
+    for (int i = 0; i < 3; i++) {
+      event->pose_event.position[i] = ntohf(frame.position[i]);
+      event->pose_event.rates[i] = ntohf(frame.rates[i]);
+      position +=
+          event->pose_event.position[i] * event->pose_event.position[i];
+      rates += event->pose_event.rates[i] * event->pose_event.rates[i];
+    }
+    for (int i = 0; i < 4; i++) {
+      event->pose_event.orientation[i] = ntohf(frame.orientation[i]);
+      norm += event->pose_event.orientation[i] *
+              event->pose_event.orientation[i];
+    }
+    /* a quaternion that can't be normalized has no orientation, and a
+     * single bad value would stay in the integrated pose */
+    if (((frame.fields & INPUT_POSE_POSITION) && !isfinite(position)) ||
+        ((frame.fields & INPUT_POSE_RATES) && !isfinite(rates)) ||
+        ((frame.fields & INPUT_POSE_ORIENTATION) &&
+         !(isfinite(norm) && norm > 1e-6f))) {
+      printf(PROGRAM_NAME ": received pose packet with invalid values\n");
       return false;
     }
+    gettimeofday(&event->ts, NULL);
+    return true;
+  }
+  /* Check for a binary IR objects packet, see struct
+   * input_socket_ir_frame */
+  if (buf_len >= sizeof(struct input_socket_ir_frame) &&
+      ((unsigned char)buf[0]) == INPUT_SOCKET_PACKET_IR_OBJECTS) {
+    struct input_socket_ir_frame frame;
+    memcpy(&frame, buf, sizeof(frame));
+
+    event->type = INPUT_EVENT_TYPE_IR;
+    for (int i = 0; i < 4; i++) {
+      struct input_socket_ir_box const *in = &frame.ir[i];
+      struct wiimote_ir_object *out = &event->ir_event.ir_object[i];
+
+      reset_ir_object(out);
+      if (in->x == 0xffff && in->y == 0xffff) {
+        continue;
+      }
+      out->x = ntohs(in->x);
+      out->y = ntohs(in->y);
+      out->size = in->size;
+      out->xmin = in->xmin;
+      out->ymin = in->ymin;
+      out->xmax = in->xmax;
+      out->ymax = in->ymax;
+      out->intensity = in->intensity;
+    }
+    gettimeofday(&event->ts, NULL);
+    return true;
   }
+  /* Check for a binary full state packet, see struct
+   * input_socket_state_frame */
+  if (buf_len >= sizeof(struct input_socket_state_frame) &&
+      ((unsigned char)buf[0]) == INPUT_SOCKET_PACKET_STATE) {
+    struct input_socket_state_frame frame;
+    memcpy(&frame, buf, sizeof(frame));
+
+    if (frame.version != INPUT_SOCKET_STATE_VERSION) {
+      printf(PROGRAM_NAME ": received state packet with unknown version %d\n",
+             frame.version);
+      return false;
+    }
 
+    event->type = INPUT_EVENT_TYPE_STATE;
+    input_socket_parse_state_frame(&frame, &event->state_event);
+    gettimeofday(&event->ts, NULL);
+    return true;
+  }
   /* Check for a binary IR update packet:
    * Format: [1 byte type 0x01] + [4 bytes float x] + [4 bytes float y] + [4
    * bytes float z] = 13 bytes */
-  if (buf_len >= 13 && ((unsigned char)buf[0]) == 0x01) {
+  else if (buf_len >= 13 &&
+           ((unsigned char)buf[0]) == INPUT_SOCKET_PACKET_IR) {
     /* printf("Received binary IR update packet\n"); */
     uint32_t net_x, net_y, net_z;
     memcpy(&net_x, buf + 1, 4);
@@ -125,13 +736,13 @@ static bool input_socket_poll_event(struct input_event *event) {
     event->analog_motion_event.y = ir_y;
     /* event->analog_motion_event.z = ir_z; */
     gettimeofday(&event->ts, NULL);
-    buf_len = 0;
     return true;
   }
   /* Check for a binary accelerometer update packet:
    * Format: [1 byte type 0x02] + [4 bytes float ax] + [4 bytes float ay] + [4
    * bytes float az] = 13 bytes */
-  else if (buf_len >= 13 && ((unsigned char)buf[0]) == 0x02) {
+  else if (buf_len >= 13 &&
+           ((unsigned char)buf[0]) == INPUT_SOCKET_PACKET_ACCEL) {
     /* printf("Received binary accelerometer update packet\n"); */
     uint32_t net_ax, net_ay, net_az;
     memcpy(&net_ax, buf + 1, 4);
@@ -146,130 +757,358 @@ static bool input_socket_poll_event(struct input_event *event) {
     event->analog_motion_event.y = ay;
     event->analog_motion_event.z = az;
     gettimeofday(&event->ts, NULL);
-    buf_len = 0;
     return true;
   } else {
-    /* Fallback to text-based protocol parsing */
-    buf[buf_len] = '\0';
-    event->type = INPUT_EVENT_TYPE_BUTTON;
-
-    char event_type_s[32], event_param_s[32];
-    int event_status;
-    if (sscanf(buf, "%32s %d %32s", event_type_s, &event_status,
-               event_param_s) == EOF) {
-      printf(PROGRAM_NAME ": received input in invalid format\n");
-      buf_len = 0;
+    /* Fallback to text-based protocol parsing, one command per line. Text
+     * ends at a NUL, so clients that send the terminator keep working. */
+    text_next = buf;
+    text_end = memchr(buf, '\0', buf_len);
+    if (!text_end) {
+      text_end = buf + buf_len;
+    }
+    gettimeofday(&text_ts, NULL);
+    return parse_text_command(event);
+  }
+}
+
+bool input_socket_parse_packet(char *buf, size_t buf_len,
+                               struct input_event *event) {
+  bool parsed = parse_packet(buf, buf_len, event);
+  /* one command per packet, further lines of a text packet are dropped */
+  text_next = text_end;
+  return parsed;
+}
+
+/* Binary packets that carry input and may have flags */
+static bool is_data_packet(unsigned char type) {
+  return (type >= INPUT_SOCKET_PACKET_IR && type <= INPUT_SOCKET_PACKET_STATE) ||
+         type == INPUT_SOCKET_PACKET_IR_OBJECTS ||
+         type == INPUT_SOCKET_PACKET_POSE;
+}
+
+/* State frames carry a sequence number of their own, checked like the one
+ * flag 0x80 adds unless that is present; 0 leaves a frame unnumbered */
+static bool check_frame_sequence(struct peer *peer, unsigned char type,
+                                 struct input_event const *event) {
+  if (!peer || (type & INPUT_SOCKET_FLAG_SEQ) ||
+      event->type != INPUT_EVENT_TYPE_STATE || event->state_event.seq == 0) {
+    return true;
+  }
+  return check_sequence(peer, INPUT_SOCKET_PACKET_STATE - 1,
+                        event->state_event.seq);
+}
+
+/* peer is NULL for ordered transports, sequence numbers aren't checked then */
+static bool parse_datagram(char *buf, size_t buf_len, struct peer *peer,
+                           struct clock_sync *clock,
+                           struct input_event *event) {
+  unsigned char type = buf[0];
+  unsigned char base_type = type & ~INPUT_SOCKET_FLAGS;
+
+  if (type == INPUT_SOCKET_PACKET_PONG) {
+    if (buf_len >= 17) {
+      uint64_t ping_time, sender_time;
+      memcpy(&ping_time, buf + 1, 8);
+      memcpy(&sender_time, buf + 9, 8);
+      add_clock_sample(clock, be64toh(ping_time), be64toh(sender_time));
+    }
+    return false;
+  }
+
+  if (!is_data_packet(base_type) || !(type & INPUT_SOCKET_FLAGS)) {
+    return parse_packet(buf, buf_len, event) &&
+           check_frame_sequence(peer, type, event);
+  }
+
+  size_t header = 1;
+  uint32_t seq;
+  uint64_t capture_time;
+  if (type & INPUT_SOCKET_FLAG_SEQ) {
+    header += sizeof seq;
+  }
+  if (type & INPUT_SOCKET_FLAG_TIME) {
+    header += sizeof capture_time;
+  }
+  if (buf_len < header) {
+    printf(PROGRAM_NAME ": received short binary packet\n");
+    return false;
+  }
+
+  if (type & INPUT_SOCKET_FLAG_SEQ) {
+    memcpy(&seq, buf + 1, sizeof seq);
+    if (peer && !check_sequence(peer, base_type - 1, ntohl(seq))) {
       return false;
     }
-    gettimeofday(&event->ts, NULL);
+  }
+  if (type & INPUT_SOCKET_FLAG_TIME) {
+    memcpy(&capture_time, buf + header - sizeof capture_time,
+           sizeof capture_time);
+    clock->stamped = true;
+  }
 
-    if (strcmp(event_type_s, "emulator_control") == 0) {
-      event->type = INPUT_EVENT_TYPE_EMULATOR_CONTROL;
+  /* drop the extra header fields, the packet goes on as if it had none */
+  buf += header - 1;
+  buf_len -= header - 1;
+  buf[0] = base_type;
+  if (!parse_packet(buf, buf_len, event) ||
+      !check_frame_sequence(peer, type, event)) {
+    return false;
+  }
 
-      if (strcmp(event_param_s, "quit") == 0) {
-        event->emulator_control_event.control = INPUT_EMULATOR_CONTROL_QUIT;
-      } else if (strcmp(event_param_s, "power_off") == 0) {
-        event->emulator_control_event.control =
-            INPUT_EMULATOR_CONTROL_POWER_OFF;
-      }
-    } else if (strcmp(event_type_s, "hotplug") == 0) {
-      event->type = INPUT_EVENT_TYPE_HOTPLUG;
-
-      if (event_status == 0) {
-        event->hotplug_event.extension = NoExtension;
-      } else if (strcmp(event_param_s, "nunchuk") == 0) {
-        event->hotplug_event.extension = Nunchuk;
-      } else if (strcmp(event_param_s, "classic") == 0) {
-        event->hotplug_event.extension = Classic;
-      } else if (strcmp(event_param_s, "balance_board") == 0) {
-        event->hotplug_event.extension = BalanceBoard;
-      } else {
-        event->hotplug_event.extension = NoExtension;
+  if ((type & INPUT_SOCKET_FLAG_TIME) && clock->samples) {
+    int64_t now = now_us();
+    int64_t captured = (int64_t)be64toh(capture_time) - clock_offset(clock);
+    /* the offset is an estimate, never let an event come from the future */
+    if (captured > now) {
+      captured = now;
+    }
+    event->ts.tv_sec = captured / 1000000;
+    event->ts.tv_usec = captured % 1000000;
+    input_socket_stamped++;
+  }
+  return true;
+}
+
+static bool input_socket_poll_event(struct input_event *event) {
+  for (;;) {
+    if (text_next < text_end) {
+      if (parse_text_command(event)) {
+        input_socket_events++;
+        return true;
       }
-    } else if (strcmp(event_type_s, "button") == 0) {
-      event->type = INPUT_EVENT_TYPE_BUTTON;
-      event->button_event.pressed = event_status;
-
-#define CHECK(Button)                                                          \
-  if (strcmp(event_param_s, #Button) == 0)                                     \
-  event->button_event.button = INPUT_BUTTON_##Button
-      CHECK(HOME);
-      else CHECK(WIIMOTE_UP);
-      else CHECK(WIIMOTE_DOWN);
-      else CHECK(WIIMOTE_LEFT);
-      else CHECK(WIIMOTE_RIGHT);
-      else CHECK(WIIMOTE_A);
-      else CHECK(WIIMOTE_B);
-      else CHECK(WIIMOTE_1);
-      else CHECK(WIIMOTE_2);
-      else CHECK(WIIMOTE_PLUS);
-      else CHECK(WIIMOTE_MINUS);
-      else CHECK(NUNCHUK_C);
-      else CHECK(NUNCHUK_Z);
-      else CHECK(CLASSIC_UP);
-      else CHECK(CLASSIC_DOWN);
-      else CHECK(CLASSIC_LEFT);
-      else CHECK(CLASSIC_RIGHT);
-      else CHECK(CLASSIC_A);
-      else CHECK(CLASSIC_B);
-      else CHECK(CLASSIC_X);
-      else CHECK(CLASSIC_Y);
-      else CHECK(CLASSIC_L);
-      else CHECK(CLASSIC_R);
-      else CHECK(CLASSIC_ZL);
-      else CHECK(CLASSIC_ZR);
-      else CHECK(CLASSIC_PLUS);
-      else CHECK(CLASSIC_MINUS);
-#undef CHECK
-      else {
-        printf(PROGRAM_NAME ": received invalid 'button' parameter: %s\n",
-               event_param_s);
-        buf_len = 0;
+      continue;
+    }
+
+    if (batch_next == batch_len) {
+      /* end this input_update's run without asking the empty socket again,
+       * the next run starts with a fresh batch */
+      if (batch_done) {
+        batch_done = false;
         return false;
       }
-    } else if (strcmp(event_type_s, "analog_motion") == 0) {
-      event->type = INPUT_EVENT_TYPE_ANALOG_MOTION;
-      event->analog_motion_event.moving = event_status;
-
-#define CHECK(Motion)                                                          \
-  if (strcmp(event_param_s, #Motion) == 0)                                     \
-  event->analog_motion_event.motion = INPUT_ANALOG_MOTION_##Motion
-      CHECK(IR_UP);
-      else CHECK(IR_DOWN);
-      else CHECK(IR_LEFT);
-      else CHECK(IR_RIGHT);
-      else CHECK(STEER_LEFT);
-      else CHECK(STEER_RIGHT);
-      else CHECK(NUNCHUK_UP);
-      else CHECK(NUNCHUK_DOWN);
-      else CHECK(NUNCHUK_LEFT);
-      else CHECK(NUNCHUK_RIGHT);
-      else CHECK(CLASSIC_LEFT_STICK_UP);
-      else CHECK(CLASSIC_LEFT_STICK_DOWN);
-      else CHECK(CLASSIC_LEFT_STICK_LEFT);
-      else CHECK(CLASSIC_LEFT_STICK_RIGHT);
-      else CHECK(MOTIONPLUS_UP);
-      else CHECK(MOTIONPLUS_DOWN);
-      else CHECK(MOTIONPLUS_LEFT);
-      else CHECK(MOTIONPLUS_RIGHT);
-      else CHECK(MOTIONPLUS_SLOW);
-#undef CHECK
-      else {
-        printf(PROGRAM_NAME
-               ": received invalid 'analog_motion' parameter: %s\n",
-               event_param_s);
-        buf_len = 0;
+      if (!receive_batch()) {
         return false;
       }
-    } else {
-      printf(PROGRAM_NAME ": received invalid event type: %s\n", event_type_s);
-      buf_len = 0;
-      return false;
     }
-    buf_len = 0;
+
+    struct mmsghdr *msg = &batch_msg[batch_next];
+    char *buf = batch_buf[batch_next];
+    struct sockaddr *addr = (struct sockaddr *)&batch_addr[batch_next];
+    batch_next++;
+
+    if (msg->msg_hdr.msg_flags & MSG_TRUNC) {
+      printf(PROGRAM_NAME ": dropped datagram longer than %d bytes\n",
+             DATAGRAM_SIZE);
+      continue;
+    }
+
+    struct peer *peer = find_peer(addr, msg->msg_hdr.msg_namelen);
+    bool parsed =
+        parse_datagram(buf, msg->msg_len, peer, &peer->clock, event);
+
+    /* unbound UNIX datagram senders can't be answered */
+    uint8_t ping[9];
+    if (peer->addr_len > sizeof(sa_family_t) && ping_due(&peer->clock, ping)) {
+      sendto(sock, ping, sizeof ping, MSG_DONTWAIT,
+             (struct sockaddr *)&peer->addr, peer->addr_len);
+    }
+
+    if (parsed) {
+      input_socket_events++;
+      return true;
+    }
+  }
+}
+
+static void close_client(int index) {
+  struct stream_client *client = &clients[index];
+  printf(PROGRAM_NAME ": input client %d disconnected\n", client->fd);
+  close(client->fd);
+  owned_fields &= ~client->owned;
+
+  if (text_client == index) {
+    text_next = text_end;
+    text_client = -1;
+  }
+
+  /* keep the array dense, the last client takes the freed place */
+  client_count--;
+  if (index != client_count) {
+    memcpy(client, &clients[client_count], sizeof *client);
+    if (text_client == client_count) {
+      text_client = index;
+    }
+  }
+  if (next_client >= client_count) {
+    next_client = 0;
+  }
+}
+
+static void accept_clients(void) {
+  int fd;
+  while ((fd = accept4(sock, NULL, NULL, SOCK_NONBLOCK)) != -1) {
+    if (client_count == STREAM_CLIENTS) {
+      printf(PROGRAM_NAME ": refused input client, %d already connected\n",
+             STREAM_CLIENTS);
+      close(fd);
+      continue;
+    }
+    struct stream_client *client = &clients[client_count++];
+    client->fd = fd;
+    client->owned = 0;
+    memset(&client->clock, 0, sizeof client->clock);
+    client->len = client->pos = 0;
+    printf(PROGRAM_NAME ": input client %d connected\n", fd);
+  }
+}
+
+/* One read per client per tick, so a client can't keep the loop busy */
+static void read_clients(void) {
+  for (int i = 0; i < client_count; i++) {
+    struct stream_client *client = &clients[i];
+    client->budget = STREAM_BUDGET;
+
+    if (client->pos) {
+      memmove(client->buf, client->buf + client->pos,
+              client->len - client->pos);
+      client->len -= client->pos;
+      client->pos = 0;
+    }
+    if (client->len == sizeof client->buf) {
+      continue;
+    }
+
+    input_socket_syscalls++;
+    ssize_t ret = recv(client->fd, client->buf + client->len,
+                       sizeof client->buf - client->len, MSG_DONTWAIT);
+    if (ret > 0) {
+      client->len += ret;
+    } else if (ret == 0 ||
+               !(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      close_client(i--);
+    }
+  }
+}
+
+/* Drops the event, or the fields of a state event, that another client owns
+ * and gives the rest to client. Returns false if nothing is left. Hotplugs
+ * only reset fields, any client may send them. */
+static bool claim_fields(struct stream_client *client,
+                         struct input_event *event) {
+  if (event->type == INPUT_EVENT_TYPE_HOTPLUG) {
     return true;
   }
+  uint16_t fields = input_event_fields(event);
+  uint16_t foreign = owned_fields & ~client->owned;
+
+  if (fields & foreign) {
+    input_socket_refused++;
+    if (event->type != INPUT_EVENT_TYPE_STATE ||
+        !(event->state_event.fields &= ~foreign)) {
+      return false;
+    }
+    fields &= ~foreign;
+  }
+
+  client->owned |= fields;
+  owned_fields |= fields;
+  return true;
+}
+
+/* Parses the next message of client into event */
+static bool next_message(int index, struct input_event *event) {
+  struct stream_client *client = &clients[index];
+  for (;;) {
+    size_t available = client->len - client->pos;
+    if (!client->budget || available < 2) {
+      return false;
+    }
+
+    uint8_t *header = (uint8_t *)client->buf + client->pos;
+    size_t length = header[0] << 8 | header[1];
+    if (length > DATAGRAM_SIZE) {
+      printf(PROGRAM_NAME ": input client %d sent a %zu byte message\n",
+             client->fd, length);
+      close_client(index);
+      return false;
+    }
+    if (available < 2 + length) {
+      return false;
+    }
+
+    char *payload = client->buf + client->pos + 2;
+    client->pos += 2 + length;
+    client->budget--;
+    input_socket_datagrams++;
+
+    text_client = index;
+    bool parsed = length && parse_datagram(payload, length, NULL,
+                                           &client->clock, event);
+
+    uint8_t ping[2 + 9] = {0, 9};
+    if (ping_due(&client->clock, ping + 2)) {
+      send(client->fd, ping, sizeof ping, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+
+    if (parsed && claim_fields(client, event)) {
+      return true;
+    }
+    /* the rest of a text message is parsed by the caller */
+    if (text_next < text_end) {
+      return false;
+    }
+  }
+}
+
+static bool input_socket_poll_stream_event(struct input_event *event) {
+  if (!tick_started) {
+    accept_clients();
+    read_clients();
+    tick_started = true;
+  }
+
+  for (;;) {
+    /* finish the lines of a text message before moving on */
+    while (text_next < text_end) {
+      if (parse_text_command(event) &&
+          claim_fields(&clients[text_client], event)) {
+        input_socket_events++;
+        return true;
+      }
+    }
+
+    /* one message from each client in turn */
+    int tried;
+    for (tried = 0; tried < client_count; tried++) {
+      int index = next_client;
+      next_client = (next_client + 1) % client_count;
+      if (next_message(index, event)) {
+        input_socket_events++;
+        return true;
+      }
+      if (text_next < text_end) {
+        break;
+      }
+    }
+    if (tried == client_count) {
+      break;
+    }
+  }
+
+  tick_started = false;
+  return false;
+}
+
+static void input_socket_unload_stream(void) {
+  while (client_count) {
+    close_client(client_count - 1);
+  }
+  input_socket_unload();
 }
 
 struct input_source input_source_socket = {
     .unload = input_socket_unload, .poll_event = input_socket_poll_event};
+
+struct input_source input_source_socket_stream = {
+    .unload = input_socket_unload_stream,
+    .poll_event = input_socket_poll_stream_event};
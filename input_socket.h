@@ -2,14 +2,132 @@
 #define INPUT_SOCKET_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include "input.h"
 
+/* Binary packet types, anything else is parsed as a text command */
+#define INPUT_SOCKET_PACKET_IR 0x01
+#define INPUT_SOCKET_PACKET_ACCEL 0x02
+#define INPUT_SOCKET_PACKET_STATE 0x03
+#define INPUT_SOCKET_PACKET_PING 0x04 /* to the sender: 64 bit time */
+#define INPUT_SOCKET_PACKET_PONG 0x05 /* 64 bit ping time, 64 bit sender time */
+#define INPUT_SOCKET_PACKET_IR_OBJECTS 0x06
+#define INPUT_SOCKET_PACKET_POSE 0x07
+
+/* Flags on the type byte of a binary packet. With INPUT_SOCKET_FLAG_SEQ a
+ * 32 bit big endian sequence number follows the type byte, counted per
+ * sender and packet type. With INPUT_SOCKET_FLAG_TIME a 64 bit big endian
+ * capture time in microseconds of the sender's clock follows (after the
+ * sequence number if both are set). The rest of the packet is unchanged. */
+#define INPUT_SOCKET_FLAG_SEQ 0x80
+#define INPUT_SOCKET_FLAG_TIME 0x40
+#define INPUT_SOCKET_FLAGS (INPUT_SOCKET_FLAG_SEQ | INPUT_SOCKET_FLAG_TIME)
+
+#define INPUT_SOCKET_STATE_VERSION 2
+
+/* An IR object slot with x and y set to 0xffff is empty */
+struct input_socket_ir_object {
+  uint16_t x;
+  uint16_t y;
+  uint8_t size;
+  uint8_t reserved;
+} __attribute__((packed));
+
+/* An IR object as the camera reports it in full mode, x and y are 10 bit,
+ * the bounding box 7 bit. x and y set to 0xffff mark an empty slot. */
+struct input_socket_ir_box {
+  uint16_t x;
+  uint16_t y;
+  uint8_t size;
+  uint8_t xmin;
+  uint8_t ymin;
+  uint8_t xmax;
+  uint8_t ymax;
+  uint8_t intensity;
+} __attribute__((packed));
+
+/* The four IR objects exactly as they should be reported, big endian */
+struct input_socket_ir_frame {
+  uint8_t type; /* INPUT_SOCKET_PACKET_IR_OBJECTS */
+  struct input_socket_ir_box ir[4];
+} __attribute__((packed));
+
+/* A controller pose, see set_pose_state, floats are sent as big endian bits.
+ * fields holds enum input_pose_field bits for the parts that are set. */
+struct input_socket_pose_frame {
+  uint8_t type; /* INPUT_SOCKET_PACKET_POSE */
+  uint8_t fields;
+  uint32_t position[3];    /* x, y, z in meters */
+  uint32_t orientation[4]; /* quaternion w, x, y, z */
+  uint32_t rates[3];       /* yaw, roll, pitch in degrees/second */
+} __attribute__((packed));
+
+/* Whole controller state in one datagram, multi-byte fields are big endian.
+ * fields holds enum input_state_field bits for the sections that are set. */
+struct input_socket_state_frame {
+  uint8_t type;    /* INPUT_SOCKET_PACKET_STATE */
+  uint8_t version; /* INPUT_SOCKET_STATE_VERSION */
+  uint16_t fields;
+  uint32_t seq; /* 0 when the frame isn't numbered */
+
+  uint32_t buttons; /* bit n set: enum input_button n pressed */
+
+  uint16_t accel[3]; /* x, y, z, 10 bit */
+
+  struct input_socket_ir_object ir[4];
+
+  uint8_t nunchuk_x;
+  uint8_t nunchuk_y;
+  uint16_t nunchuk_accel[3];
+
+  uint8_t classic_ls_x;
+  uint8_t classic_ls_y;
+  uint8_t classic_rs_x;
+  uint8_t classic_rs_y;
+  uint8_t classic_lt;
+  uint8_t classic_rt;
+
+  uint32_t motionplus[3]; /* yaw, roll, pitch in degrees/second, float bits */
+} __attribute__((packed));
+
+/* Converts a frame from network order, the version must have been checked */
+void input_socket_parse_state_frame(
+    struct input_socket_state_frame const *frame,
+    struct input_state_event *event);
+
+/* Parses a single packet without flags, binary or one text command, as it
+ * would arrive on a socket. Returns false if it holds no valid event. */
+bool input_socket_parse_packet(char *buf, size_t buf_len,
+                               struct input_event *event);
+
 void input_socket_init_unix_at_path(char const *path);
 void input_socket_init_ip_on_port(char const *port);
 void input_socket_init(struct sockaddr *socket_address, socklen_t socket_address_size);
 
+/* Stream servers accepting several clients, use input_source_socket_stream */
+void input_socket_init_stream_unix_at_path(char const *path);
+void input_socket_init_stream_ip_on_port(char const *port);
+
 extern struct input_source input_source_socket;
+extern struct input_source input_source_socket_stream;
+
+/* events stamped with the sender's capture time, and pongs received */
+extern uint64_t input_socket_stamped;
+extern uint64_t input_socket_pongs;
+
+/* sequence numbers skipped, and packets dropped for arriving late or twice */
+extern uint64_t input_socket_lost;
+extern uint64_t input_socket_reordered;
+extern uint64_t input_socket_duplicates;
+
+/* events dropped because another stream client owns the fields they set */
+extern uint64_t input_socket_refused;
+
+/* recvmmsg calls, datagrams received and events parsed from them */
+extern uint64_t input_socket_syscalls;
+extern uint64_t input_socket_datagrams;
+extern uint64_t input_socket_events;
 
 #endif
@@ -0,0 +1,183 @@
+#include "interp.h"
+
+#include "motion.h"
+#include "vector_math_simd.h"
+#include <math.h>
+#include <stdbool.h>
+
+// All channels sit in one row of float lanes, so blending the two samples
+// is the same few vector operations whatever the channels are:
+//   0: accelerometer x, y, z
+//   1: nunchuk stick x, y
+//   2: MotionPlus yaw, roll, pitch in degrees/second
+//   3: IR objects 0 and 1 x, y
+//   4: IR objects 2 and 3 x, y
+#define INTERP_LANES 5
+
+static const int lane_channel[INTERP_LANES] = {
+    INTERP_ACCEL, INTERP_NUNCHUK, INTERP_MOTIONPLUS, INTERP_IR, INTERP_IR};
+
+static double delay = 0;
+static double max_extrapolation = 0;
+
+static struct {
+  vec4f prev[INTERP_LANES];
+  vec4f last[INTERP_LANES];
+  struct timeval prev_ts[INTERP_CHANNELS];
+  struct timeval last_ts[INTERP_CHANNELS];
+  int samples[INTERP_CHANNELS]; // up to 2
+  // the newest IR objects, with the sizes and bounds the lanes don't carry,
+  // and which of them were visible in each sample
+  struct wiimote_ir_object ir_object[4];
+  bool prev_visible[4];
+  bool last_visible[4];
+} interp;
+
+uint64_t interp_interpolated = 0;
+uint64_t interp_extrapolated = 0;
+uint64_t interp_held = 0;
+
+static double seconds_between(struct timeval const *from,
+                              struct timeval const *to) {
+  return (to->tv_sec - from->tv_sec) + (to->tv_usec - from->tv_usec) / 1e6;
+}
+
+static uint16_t to_range(float value, float max) {
+  return lrintf(fmaxf(0, fminf(max, value)));
+}
+
+static bool ir_visible(struct wiimote_ir_object const *object) {
+  return object->x < 1024 && object->y < 768;
+}
+
+void interp_init(double sample_delay, double extrapolation_limit) {
+  delay = fmax(0, sample_delay);
+  max_extrapolation = fmax(0, extrapolation_limit);
+  interp_reset();
+}
+
+void interp_reset(void) {
+  for (int channel = 0; channel < INTERP_CHANNELS; channel++) {
+    interp.samples[channel] = 0;
+  }
+}
+
+void interp_sample(struct wiimote_state const *state,
+                   enum interp_channel channel, struct timeval const *ts) {
+  struct wiimote_ir_object const *ir = state->usr.ir_object;
+  float yaw, roll, pitch;
+
+  for (int lane = 0; lane < INTERP_LANES; lane++) {
+    if (lane_channel[lane] == channel) {
+      interp.prev[lane] = interp.last[lane];
+    }
+  }
+
+  switch (channel) {
+  case INTERP_ACCEL:
+    interp.last[0] = (vec4f){state->usr.accel_x, state->usr.accel_y,
+                             state->usr.accel_z, 0};
+    break;
+  case INTERP_NUNCHUK:
+    interp.last[1] =
+        (vec4f){state->usr.nunchuk.x, state->usr.nunchuk.y, 0, 0};
+    break;
+  case INTERP_MOTIONPLUS:
+    get_motionplus_rates(state, &yaw, &roll, &pitch);
+    interp.last[2] = (vec4f){yaw, roll, pitch, 0};
+    break;
+  case INTERP_IR:
+    interp.last[3] = (vec4f){ir[0].x, ir[0].y, ir[1].x, ir[1].y};
+    interp.last[4] = (vec4f){ir[2].x, ir[2].y, ir[3].x, ir[3].y};
+    for (int i = 0; i < 4; i++) {
+      interp.ir_object[i] = ir[i];
+      interp.prev_visible[i] = interp.last_visible[i];
+      interp.last_visible[i] = ir_visible(&ir[i]);
+    }
+    break;
+  default:
+    return;
+  }
+
+  interp.prev_ts[channel] = interp.last_ts[channel];
+  interp.last_ts[channel] = *ts;
+  if (interp.samples[channel] < 2) {
+    interp.samples[channel]++;
+  }
+}
+
+// Position of now - delay on the line through the two samples, 0 at the
+// older one and 1 at the newer one.
+static float channel_weight(int channel, struct timeval const *now) {
+  double span =
+      seconds_between(&interp.prev_ts[channel], &interp.last_ts[channel]);
+  if (span <= 0) {
+    return 1;
+  }
+
+  double past_last = seconds_between(&interp.last_ts[channel], now) - delay;
+  if (past_last > max_extrapolation) {
+    past_last = max_extrapolation;
+    interp_held++;
+  } else if (past_last > 0) {
+    interp_extrapolated++;
+  } else {
+    interp_interpolated++;
+  }
+
+  return fmax(0, 1 + past_last / span);
+}
+
+void interp_apply(struct wiimote_state *state, unsigned channels,
+                  struct timeval const *now) {
+  float weight[INTERP_CHANNELS];
+  vec4f value[INTERP_LANES];
+
+  for (int channel = 0; channel < INTERP_CHANNELS; channel++) {
+    if (!(channels & (1 << channel)) || interp.samples[channel] < 2) {
+      channels &= ~(1 << channel);
+      weight[channel] = 1;
+      continue;
+    }
+    weight[channel] = channel_weight(channel, now);
+  }
+  if (!channels) {
+    return;
+  }
+
+  for (int lane = 0; lane < INTERP_LANES; lane++) {
+    vec4f prev = interp.prev[lane], last = interp.last[lane];
+    value[lane] =
+        prev + (last - prev) * vec4f_splat(weight[lane_channel[lane]]);
+  }
+
+  if (channels & (1 << INTERP_ACCEL)) {
+    state->usr.accel_x = to_range(value[0][0], 1023);
+    state->usr.accel_y = to_range(value[0][1], 1023);
+    state->usr.accel_z = to_range(value[0][2], 1023);
+  }
+
+  if (channels & (1 << INTERP_NUNCHUK)) {
+    state->usr.nunchuk.x = to_range(value[1][0], 255);
+    state->usr.nunchuk.y = to_range(value[1][1], 255);
+  }
+
+  if (channels & (1 << INTERP_MOTIONPLUS)) {
+    set_motionplus_rates(state, value[2][0], value[2][1], value[2][2]);
+  }
+
+  if (channels & (1 << INTERP_IR)) {
+    // objects that just appeared or went away stay where the newest sample
+    // has them
+    for (int i = 0; i < 4; i++) {
+      struct wiimote_ir_object *object = &state->usr.ir_object[i];
+      *object = interp.ir_object[i];
+      if (interp.prev_visible[i] && interp.last_visible[i]) {
+        vec4f pair = value[3 + i / 2];
+        object->x = to_range(pair[i % 2 * 2], 1023);
+        object->y = to_range(pair[i % 2 * 2 + 1], 767);
+      }
+    }
+    invalidate_motion_state();
+  }
+}
@@ -0,0 +1,37 @@
+#ifndef INTERP_H
+#define INTERP_H
+
+#include "wiimote.h"
+#include <stdint.h>
+#include <sys/time.h>
+
+/* Analog parts of the state that are interpolated between the last two
+ * samples a producer sent, so reports built faster than the producer sends
+ * see a value moving with time instead of steps. */
+enum interp_channel {
+  INTERP_ACCEL,
+  INTERP_NUNCHUK,     /* stick */
+  INTERP_MOTIONPLUS,  /* rates */
+  INTERP_IR,          /* positions of the visible objects */
+  INTERP_CHANNELS
+};
+
+/* Reports get the value the samples had delay seconds ago, extrapolated at
+ * most max_extrapolation seconds past the newest sample. */
+void interp_init(double delay, double max_extrapolation);
+/* Forgets the samples, after something else reset the state */
+void interp_reset(void);
+/* Takes the channel's current value in state as a sample taken at ts */
+void interp_sample(struct wiimote_state const *state,
+                   enum interp_channel channel, struct timeval const *ts);
+/* Sets the channels in the (1 << channel) mask to their value at now */
+void interp_apply(struct wiimote_state *state, unsigned channels,
+                  struct timeval const *now);
+
+/* channel values set between two samples, past the newest one, and held at
+ * the extrapolation limit */
+extern uint64_t interp_interpolated;
+extern uint64_t interp_extrapolated;
+extern uint64_t interp_held;
+
+#endif
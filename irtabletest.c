@@ -0,0 +1,20 @@
+#include <stdio.h>
+
+#include "motion.h"
+
+/* Builds the IR lookup table over the pointer range input_use_ir_table uses
+ * and fails when it strays further from the exact projection than
+ * IR_TABLE_MAX_ERROR. */
+
+int main(int argc, char *argv[]) {
+  double error = build_ir_table(-POINTER_MARGIN, 1.0 + POINTER_MARGIN);
+
+  printf("Max error: %.3f camera pixels, bound %.1f\n", error,
+         IR_TABLE_MAX_ERROR);
+  if (error > IR_TABLE_MAX_ERROR) {
+    printf("FAIL\n");
+    return 1;
+  }
+  printf("OK\n");
+  return 0;
+}
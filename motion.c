@@ -1,6 +1,6 @@
 #include "motion.h"
 
-#include "vector_math.h"
+#include "vector_math_simd.h"
 
 // units in meters
 static const double screen_distance = 2;
@@ -18,6 +18,51 @@ static const double cam_near = 0.5;
 static const uint16_t accelerometer_zero = 0x85 << 2;
 static const uint16_t accelerometer_unit = 0x6C;
 
+// motionplus gyro, 14 bit per axis, units per degree/second in slow mode;
+// fast mode covers a range 2000/440 times larger
+static const uint16_t motionplus_zero = 0x1F7F;
+static const uint16_t motionplus_max = 0x3FFF;
+static const double motionplus_slow_unit = 20.0;
+static const double motionplus_fast_unit = 20.0 * 440.0 / 2000.0;
+
+// Inputs of the last set_motion_state call. Its output is still in the state
+// until they change or something else writes the same fields.
+static struct {
+  const struct wiimote_state *state;
+  float pointer_x;
+  float pointer_y;
+  bool valid;
+} motion_cache;
+
+uint64_t motion_updates = 0;
+uint64_t motion_skips = 0;
+
+// MotionPlus rates synthesized from the pointer model's orientation, taken
+// between consecutive pointer samples and held until the next one is due
+static struct {
+  quat sample;
+  struct timeval sample_ts;
+  bool has_sample;
+  vec3 rates;  // radians/second about the controller's axes
+  double hold; // seconds past sample_ts the rates still apply
+} gyro;
+
+// Optional lookup table of the sensor bar projection over the pointer range,
+// interpolated bilinearly. Each node holds x, y and z of both points.
+#define IR_TABLE_CELLS 64
+// error samples per cell and axis when the table is checked
+#define IR_TABLE_CHECKS 4
+
+struct ir_table_node {
+  vec4f pt0;
+  vec4f pt1;
+};
+
+static struct ir_table_node ir_table[IR_TABLE_CELLS + 1][IR_TABLE_CELLS + 1];
+static bool ir_table_ready = false;
+static float ir_table_min;
+static float ir_table_scale;
+
 void look_at_pointer(mat4 *wiimote_mat, float pointer_x, float pointer_y) {
   vec3 pointer_world = {(pointer_x - 0.5) * screen_width,
                         (pointer_y)*screen_width, -screen_distance};
@@ -62,14 +107,8 @@ void make_cam_projection_mat(mat4 *proj_mat) {
   proj_mat->v3 = (vec4){0.0, 0.0, -2.0 * far * near / (far - near), 0.0};
 }
 
-void set_accelerometer(struct wiimote_state *state, const mat4 *wiimote_mat) {
-  vec3 accel = {0, -1.0, 0};
-  mat3 accel_m;
-  mat3_from_mat4(&accel_m, wiimote_mat);
-  mat3_invert(&accel_m);
-  mat3_transpose(&accel_m);
-  vec3_apply_mat3(&accel, &accel_m);
-
+// accel is the direction of gravity in the controller's frame, in g
+static void encode_accelerometer(struct wiimote_state *state, vec3 accel) {
   accel.x = fmax(-3.4, fmin(3.4, accel.x));
   accel.y = fmax(-3.4, fmin(3.4, accel.y));
   accel.z = fmax(-3.4, fmin(3.4, accel.z));
@@ -83,64 +122,384 @@ void set_accelerometer(struct wiimote_state *state, const mat4 *wiimote_mat) {
       accelerometer_zero + (int)round((double)accelerometer_unit * accel.z);
 }
 
-void set_motionplus(struct wiimote_state *state, const mat4 *wiimote_mat) {}
+void set_accelerometer(struct wiimote_state *state, const mat4 *wiimote_mat) {
+  vec3 accel = {0, -1.0, 0};
+  mat3 accel_m;
+  mat3_from_mat4(&accel_m, wiimote_mat);
+  mat3_invert(&accel_m);
+  mat3_transpose(&accel_m);
+  vec3_apply_mat3(&accel, &accel_m);
+
+  encode_accelerometer(state, accel);
+}
+
+// Encodes one axis in degrees/second, using slow mode while it fits.
+static uint16_t encode_motionplus_rate(double rate, bool *slow) {
+  double value = rate * motionplus_slow_unit;
 
-void set_motion_state(struct wiimote_state *state, float pointer_x,
-                      float pointer_y) {
-  mat4 wiimote_mat;
-  look_at_pointer(&wiimote_mat, pointer_x, pointer_y);
+  *slow = fabs(value) < motionplus_zero;
+  if (!*slow) {
+    value = rate * motionplus_fast_unit;
+  }
 
-  mat4 view_mat = wiimote_mat;
-  mat4_invert(&view_mat);
+  value = fmax(-motionplus_zero, fmin(motionplus_max - motionplus_zero, value));
+  return motionplus_zero + (int)round(value);
+}
+
+void set_motionplus_rates(struct wiimote_state *state, float yaw, float roll,
+                          float pitch) {
+  struct wiimote_motionplus *motionplus = &state->usr.motionplus;
+
+  motionplus->yaw_down = encode_motionplus_rate(yaw, &motionplus->yaw_slow);
+  motionplus->roll_left = encode_motionplus_rate(roll, &motionplus->roll_slow);
+  motionplus->pitch_left =
+      encode_motionplus_rate(pitch, &motionplus->pitch_slow);
+}
+
+static float decode_motionplus_rate(uint16_t value, bool slow) {
+  return (value - motionplus_zero) /
+         (slow ? motionplus_slow_unit : motionplus_fast_unit);
+}
 
-  mat4 model_mat;
-  vec3 model_pos = (vec3){0.0, sensor_bar_y, -screen_distance};
-  mat4_make_translation(&model_mat, &model_pos);
+void get_motionplus_rates(const struct wiimote_state *state, float *yaw,
+                          float *roll, float *pitch) {
+  const struct wiimote_motionplus *motionplus = &state->usr.motionplus;
 
-  mat4 proj_mat;
-  make_cam_projection_mat(&proj_mat);
+  *yaw = decode_motionplus_rate(motionplus->yaw_down, motionplus->yaw_slow);
+  *roll = decode_motionplus_rate(motionplus->roll_left, motionplus->roll_slow);
+  *pitch =
+      decode_motionplus_rate(motionplus->pitch_left, motionplus->pitch_slow);
+}
 
-  mat4_mult(&view_mat, &model_mat);
-  mat4_mult(&proj_mat, &view_mat);
+// The projection only depends on the constants above, so it's built once.
+static const mat4 *cam_projection_mat(void) {
+  static mat4 proj_mat;
+  static bool ready;
 
-  vec4 sensor_pt0 = {-sensor_bar_width * 0.5, 0.0, 0.0, 1.0};
-  vec4 sensor_pt1 = {sensor_bar_width * 0.5, 0.0, 0.0, 1.0};
+  if (!ready) {
+    make_cam_projection_mat(&proj_mat);
+    ready = true;
+  }
+  return &proj_mat;
+}
 
-  vec4_apply_mat4(&sensor_pt0, &proj_mat);
-  vec4_apply_mat4(&sensor_pt1, &proj_mat);
+// Takes a point in eye space into the camera's 0..1 range, evaluating only
+// the non-zero terms of the projection.
+static void eye_to_camera(vec4 *out, const mat4 *proj_mat, double eye_x,
+                          double eye_y, double eye_z) {
+  out->x = proj_mat->v0.x * eye_x + proj_mat->v2.x * eye_z;
+  out->y = proj_mat->v1.y * eye_y + proj_mat->v2.y * eye_z;
+  out->z = proj_mat->v2.z * eye_z + proj_mat->v3.z;
+  out->w = proj_mat->v2.w * eye_z;
+
+  vec4_multiply_scalar(out, 1 / out->w);
+  vec4_add_scalar(out, 1.0);
+  vec4_multiply_scalar(out, 0.5);
+}
 
-  vec4_multiply_scalar(&sensor_pt0, 1 / sensor_pt0.w);
-  vec4_multiply_scalar(&sensor_pt1, 1 / sensor_pt1.w);
+// Projects a point of the sensor bar into the camera's 0..1 range. The
+// wiimote matrix is a pure rotation, so the view transform is its transpose.
+static void project_sensor_point(vec4 *out, const mat4 *wiimote_mat,
+                                 const mat4 *proj_mat, const vec3 *pt) {
+  const vec4 *x = &wiimote_mat->v0, *y = &wiimote_mat->v1,
+             *z = &wiimote_mat->v2;
 
-  vec4_add_scalar(&sensor_pt0, 1.0);
-  vec4_multiply_scalar(&sensor_pt0, 0.5);
+  double eye_x = x->x * pt->x + x->y * pt->y + x->z * pt->z;
+  double eye_y = y->x * pt->x + y->y * pt->y + y->z * pt->z;
+  double eye_z = z->x * pt->x + z->y * pt->y + z->z * pt->z;
 
-  vec4_add_scalar(&sensor_pt1, 1.0);
-  vec4_multiply_scalar(&sensor_pt1, 0.5);
+  eye_to_camera(out, proj_mat, eye_x, eye_y, eye_z);
+}
 
+// Reports the projected sensor bar points as the first two IR objects, the
+// ones outside the camera's view are left empty.
+static void set_sensor_bar_objects(struct wiimote_state *state,
+                                   const vec4 *sensor_pt0,
+                                   const vec4 *sensor_pt1) {
   double min_pt_size = 1.0;
   double max_pt_size = 15.0;
 
   reset_ir_object(&state->usr.ir_object[0]);
   reset_ir_object(&state->usr.ir_object[1]);
 
-  if (sensor_pt0.x > 0 && sensor_pt0.x < 1 && sensor_pt0.y > 0 &&
-      sensor_pt0.y < 1 && sensor_pt0.z > 0 && sensor_pt0.z < 1) {
-    state->usr.ir_object[0].x = round(sensor_pt0.x * 1023);
-    state->usr.ir_object[0].y = round(sensor_pt0.y * 767);
+  if (sensor_pt0->x > 0 && sensor_pt0->x < 1 && sensor_pt0->y > 0 &&
+      sensor_pt0->y < 1 && sensor_pt0->z > 0 && sensor_pt0->z < 1) {
+    state->usr.ir_object[0].x = round(sensor_pt0->x * 1023);
+    state->usr.ir_object[0].y = round(sensor_pt0->y * 767);
     state->usr.ir_object[0].size =
         round(min_pt_size +
-              pow(1.0 - sensor_pt0.z, 2.0) * (max_pt_size - min_pt_size));
+              pow(1.0 - sensor_pt0->z, 2.0) * (max_pt_size - min_pt_size));
   }
 
-  if (sensor_pt1.x > 0 && sensor_pt1.x < 1 && sensor_pt1.y > 0 &&
-      sensor_pt1.y < 1 && sensor_pt1.z > 0 && sensor_pt1.z < 1) {
-    state->usr.ir_object[1].x = round(sensor_pt1.x * 1023);
-    state->usr.ir_object[1].y = round(sensor_pt1.y * 767);
+  if (sensor_pt1->x > 0 && sensor_pt1->x < 1 && sensor_pt1->y > 0 &&
+      sensor_pt1->y < 1 && sensor_pt1->z > 0 && sensor_pt1->z < 1) {
+    state->usr.ir_object[1].x = round(sensor_pt1->x * 1023);
+    state->usr.ir_object[1].y = round(sensor_pt1->y * 767);
     state->usr.ir_object[1].size =
         round(min_pt_size +
-              pow(1.0 - sensor_pt1.z, 2.0) * (max_pt_size - min_pt_size));
+              pow(1.0 - sensor_pt1->z, 2.0) * (max_pt_size - min_pt_size));
   }
+}
+
+// Projects both sensor bar points for a pointer position.
+static void project_sensor_bar(vec4 *sensor_pt0, vec4 *sensor_pt1,
+                               float pointer_x, float pointer_y) {
+  mat4 wiimote_mat;
+  look_at_pointer(&wiimote_mat, pointer_x, pointer_y);
+
+  const mat4 *proj_mat = cam_projection_mat();
+
+  vec3 bar_pt0 = {-sensor_bar_width * 0.5, sensor_bar_y, -screen_distance};
+  vec3 bar_pt1 = {sensor_bar_width * 0.5, sensor_bar_y, -screen_distance};
+
+  project_sensor_point(sensor_pt0, &wiimote_mat, proj_mat, &bar_pt0);
+  project_sensor_point(sensor_pt1, &wiimote_mat, proj_mat, &bar_pt1);
+}
+
+static vec4f lerp(vec4f a, vec4f b, vec4f t) { return a + (b - a) * t; }
+
+static void lookup_sensor_bar(vec4 *sensor_pt0, vec4 *sensor_pt1,
+                              float pointer_x, float pointer_y) {
+  float u = (pointer_x - ir_table_min) * ir_table_scale;
+  float v = (pointer_y - ir_table_min) * ir_table_scale;
+  int i = fminf(fmaxf(floorf(u), 0), IR_TABLE_CELLS - 1);
+  int j = fminf(fmaxf(floorf(v), 0), IR_TABLE_CELLS - 1);
+  vec4f tu = vec4f_splat(u - i), tv = vec4f_splat(v - j);
+
+  const struct ir_table_node *n00 = &ir_table[j][i], *n01 = &ir_table[j][i + 1],
+                             *n10 = &ir_table[j + 1][i],
+                             *n11 = &ir_table[j + 1][i + 1];
+
+  vec4f pt0 = lerp(lerp(n00->pt0, n01->pt0, tu), lerp(n10->pt0, n11->pt0, tu),
+                   tv);
+  vec4f pt1 = lerp(lerp(n00->pt1, n01->pt1, tu), lerp(n10->pt1, n11->pt1, tu),
+                   tv);
+
+  *sensor_pt0 = (vec4){pt0[0], pt0[1], pt0[2], 1.0};
+  *sensor_pt1 = (vec4){pt1[0], pt1[1], pt1[2], 1.0};
+}
+
+static double camera_pixel_error(const vec4 *exact, const vec4 *approx) {
+  return fmax(fabs(exact->x - approx->x) * 1023,
+              fabs(exact->y - approx->y) * 767);
+}
+
+double build_ir_table(float pointer_min, float pointer_max) {
+  float step = (pointer_max - pointer_min) / IR_TABLE_CELLS;
+
+  for (int j = 0; j <= IR_TABLE_CELLS; j++) {
+    for (int i = 0; i <= IR_TABLE_CELLS; i++) {
+      vec4 pt0, pt1;
+      project_sensor_bar(&pt0, &pt1, pointer_min + i * step,
+                         pointer_min + j * step);
+      ir_table[j][i].pt0 = (vec4f){pt0.x, pt0.y, pt0.z, 0.0f};
+      ir_table[j][i].pt1 = (vec4f){pt1.x, pt1.y, pt1.z, 0.0f};
+    }
+  }
+
+  ir_table_min = pointer_min;
+  ir_table_scale = 1 / step;
+  ir_table_ready = true;
+  invalidate_motion_state();
+
+  // bilinear error peaks inside the cells, away from the nodes
+  double max_error = 0;
+  for (int j = 0; j < IR_TABLE_CELLS * IR_TABLE_CHECKS; j++) {
+    for (int i = 0; i < IR_TABLE_CELLS * IR_TABLE_CHECKS; i++) {
+      float x = pointer_min + (i + 0.5f) * step / IR_TABLE_CHECKS;
+      float y = pointer_min + (j + 0.5f) * step / IR_TABLE_CHECKS;
+      vec4 exact0, exact1, approx0, approx1;
+      project_sensor_bar(&exact0, &exact1, x, y);
+      lookup_sensor_bar(&approx0, &approx1, x, y);
+      max_error = fmax(max_error, camera_pixel_error(&exact0, &approx0));
+      max_error = fmax(max_error, camera_pixel_error(&exact1, &approx1));
+    }
+  }
+  return max_error;
+}
+
+void invalidate_motion_state(void) { motion_cache.valid = false; }
+
+void set_motion_state(struct wiimote_state *state, float pointer_x,
+                      float pointer_y) {
+  if (motion_cache.valid && motion_cache.state == state &&
+      motion_cache.pointer_x == pointer_x &&
+      motion_cache.pointer_y == pointer_y) {
+    motion_skips++;
+    return;
+  }
+
+  vec4 sensor_pt0, sensor_pt1;
+  if (ir_table_ready) {
+    lookup_sensor_bar(&sensor_pt0, &sensor_pt1, pointer_x, pointer_y);
+  } else {
+    project_sensor_bar(&sensor_pt0, &sensor_pt1, pointer_x, pointer_y);
+  }
+
+  set_sensor_bar_objects(state, &sensor_pt0, &sensor_pt1);
 
   /* set_accelerometer(state, &wiimote_mat); */
+
+  motion_cache.state = state;
+  motion_cache.pointer_x = pointer_x;
+  motion_cache.pointer_y = pointer_y;
+  motion_cache.valid = true;
+  motion_updates++;
+}
+
+// Longest step the pose model integrates over, orientation samples further
+// apart than this don't give angular rates
+static const double pose_max_step = 0.1;
+
+// Controller pose in the frame above: the player at the origin facing the
+// screen along -z, y up. The orientation turns the controller's axes (x right,
+// y up, pointing along -z) into that frame, rates are about the controller's
+// axes in radians/second.
+static struct {
+  vec3 position;
+  quat orientation;
+  vec3 rates;
+  struct timeval ts;
+  // last orientation received, rates are derived from consecutive ones
+  quat sample;
+  struct timeval sample_ts;
+  bool has_sample;
+  // rates come from orientations rather than given directly
+  bool derived_rates;
+  bool valid;
+} pose = {.orientation = {1.0, 0.0, 0.0, 0.0}};
+
+static double seconds_between(const struct timeval *from,
+                              const struct timeval *to) {
+  return (to->tv_sec - from->tv_sec) + (to->tv_usec - from->tv_usec) / 1e6;
+}
+
+static double degrees(double angle) { return angle * 180.0 / M_PI; }
+
+static double radians(double angle) { return angle * M_PI / 180.0; }
+
+// Reports rates about the controller's axes, in radians/second, plus extra
+// yaw, roll and pitch in degrees/second. Yaw turns left about y, roll turns
+// about z, and pitch is positive with the tip going down (against x), as
+// the digital MotionPlus actions have always reported them.
+static void set_body_rates(struct wiimote_state *state, const vec3 *rates,
+                           float yaw, float roll, float pitch) {
+  set_motionplus_rates(state, yaw + degrees(rates->y),
+                       roll + degrees(rates->z), pitch - degrees(rates->x));
+}
+
+void set_pose_state(struct wiimote_state *state, const float *position,
+                    const float *orientation, const float *rates,
+                    const struct timeval *ts) {
+  // carry the orientation forward to ts at the current rates
+  if (pose.valid) {
+    double dt = seconds_between(&pose.ts, ts);
+    if (dt > 0) {
+      quat_integrate(&pose.orientation, &pose.rates, fmin(dt, pose_max_step));
+      pose.ts = *ts;
+    }
+  } else {
+    pose.ts = *ts;
+    pose.valid = true;
+  }
+
+  if (orientation) {
+    quat sample = {orientation[0], orientation[1], orientation[2],
+                   orientation[3]};
+    quat_normalize(&sample);
+
+    if (!rates && pose.has_sample) {
+      double dt = seconds_between(&pose.sample_ts, ts);
+      pose.derived_rates = true;
+      if (dt > pose_max_step) {
+        pose.rates = (vec3){0.0, 0.0, 0.0};
+      } else if (dt > 0) {
+        quat_rates(&pose.rates, &pose.sample, &sample, dt);
+      }
+    }
+
+    pose.orientation = pose.sample = sample;
+    pose.sample_ts = *ts;
+    pose.has_sample = true;
+  } else if (!rates && pose.derived_rates &&
+             seconds_between(&pose.sample_ts, ts) > pose_max_step) {
+    // orientation samples stopped, so has the controller
+    pose.rates = (vec3){0.0, 0.0, 0.0};
+  }
+
+  if (rates) {
+    pose.rates =
+        (vec3){-radians(rates[2]), radians(rates[0]), radians(rates[1])};
+    pose.derived_rates = false;
+  }
+
+  if (position) {
+    pose.position = (vec3){position[0], position[1], position[2]};
+  }
+
+  quat world_to_body = pose.orientation;
+  quat_conjugate(&world_to_body);
+
+  vec3 gravity = {0.0, -1.0, 0.0};
+  vec3_rotate_quat(&gravity, &world_to_body);
+  encode_accelerometer(state, gravity);
+
+  const mat4 *proj_mat = cam_projection_mat();
+  vec3 bar_pt0 = {-sensor_bar_width * 0.5 - pose.position.x,
+                  sensor_bar_y - pose.position.y,
+                  -screen_distance - pose.position.z};
+  vec3 bar_pt1 = {sensor_bar_width * 0.5 - pose.position.x,
+                  sensor_bar_y - pose.position.y,
+                  -screen_distance - pose.position.z};
+  vec3_rotate_quat(&bar_pt0, &world_to_body);
+  vec3_rotate_quat(&bar_pt1, &world_to_body);
+
+  vec4 sensor_pt0, sensor_pt1;
+  eye_to_camera(&sensor_pt0, proj_mat, bar_pt0.x, bar_pt0.y, bar_pt0.z);
+  eye_to_camera(&sensor_pt1, proj_mat, bar_pt1.x, bar_pt1.y, bar_pt1.z);
+  set_sensor_bar_objects(state, &sensor_pt0, &sensor_pt1);
+  invalidate_motion_state();
+
+  set_body_rates(state, &pose.rates, 0, 0, 0);
+}
+
+void sample_pointer_motion(float pointer_x, float pointer_y,
+                           const struct timeval *ts) {
+  mat4 wiimote_mat;
+  look_at_pointer(&wiimote_mat, pointer_x, pointer_y);
+  quat orientation;
+  quat_from_mat4(&orientation, &wiimote_mat);
+
+  double dt = gyro.has_sample ? seconds_between(&gyro.sample_ts, ts) : 0;
+  if (gyro.has_sample && dt <= 0) {
+    // same sample time, nothing to learn the rates from
+    return;
+  }
+  if (dt > 0 && dt <= pose_max_step) {
+    quat_rates(&gyro.rates, &gyro.sample, &orientation, dt);
+    // until a sample is clearly overdue, the pointer is taken to be turning
+    gyro.hold = fmin(2 * dt, pose_max_step);
+  } else {
+    gyro.rates = (vec3){0.0, 0.0, 0.0};
+    gyro.hold = 0;
+  }
+
+  gyro.sample = orientation;
+  gyro.sample_ts = *ts;
+  gyro.has_sample = true;
+}
+
+void reset_pointer_motion(void) {
+  gyro.has_sample = false;
+  gyro.rates = (vec3){0.0, 0.0, 0.0};
+}
+
+void synthesize_motionplus(struct wiimote_state *state, float yaw, float roll,
+                           float pitch, const struct timeval *now) {
+  vec3 rates = {0.0, 0.0, 0.0};
+  if (gyro.has_sample && seconds_between(&gyro.sample_ts, now) <= gyro.hold) {
+    rates = gyro.rates;
+  }
+
+  set_body_rates(state, &rates, yaw, roll, pitch);
 }
@@ -2,8 +2,52 @@
 #define MOTION_H
 
 #include "wiimote.h"
+#include <sys/time.h>
 
 void set_motion_state(struct wiimote_state *state, float pointer_x,
                       float pointer_y);
+// Forces the next set_motion_state call to recompute its output, for when
+// the fields it sets were written by something else.
+void invalidate_motion_state(void);
+// Switches set_motion_state to a lookup table of the sensor bar projection
+// for pointer positions from pointer_min to pointer_max on both axes.
+// Returns the largest deviation from the exact projection in camera pixels.
+double build_ir_table(float pointer_min, float pointer_max);
+// The deviation build_ir_table is expected to stay within, in camera pixels
+#define IR_TABLE_MAX_ERROR 0.5
+// How far the pointer may leave the screen on each side, in screen widths;
+// the IR table covers the same range
+#define POINTER_MARGIN 0.5
+void set_motionplus_rates(struct wiimote_state *state, float yaw, float roll,
+                          float pitch);
+// Reads back the rates in degrees/second
+void get_motionplus_rates(const struct wiimote_state *state, float *yaw,
+                          float *roll, float *pitch);
+// Moves the controller pose to the time ts and sets the accelerometer, the
+// sensor bar IR objects and MotionPlus rates from it. position is in meters
+// with the player at the origin facing the screen along -z, orientation a
+// quaternion (w, x, y, z) and rates are yaw, roll and pitch in degrees/second.
+// Parts left NULL keep their value, and the orientation keeps turning at the
+// current rates, derived from consecutive orientations if none are given.
+void set_pose_state(struct wiimote_state *state, const float *position,
+                    const float *orientation, const float *rates,
+                    const struct timeval *ts);
+
+// Feeds the pointer position sampled at ts to the MotionPlus rates, which
+// follow the pointer model's rotation from one sample to the next.
+// reset_pointer_motion forgets the last sample, for when the pointer jumps.
+void sample_pointer_motion(float pointer_x, float pointer_y,
+                           const struct timeval *ts);
+void reset_pointer_motion(void);
+// Sets MotionPlus from the rates of the last pointer samples, held until
+// the next sample is overdue, plus the given rates in degrees/second.
+// Called right before a report is built.
+void synthesize_motionplus(struct wiimote_state *state, float yaw, float roll,
+                           float pitch, const struct timeval *now);
+
+// set_motion_state calls that recomputed the state, and the ones skipped
+// because the pointer hadn't moved
+extern uint64_t motion_updates;
+extern uint64_t motion_skips;
 
 #endif
@@ -0,0 +1,406 @@
+#include "session_log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROGRAM_NAME "wmemulator"
+
+/* Records waiting for the writer thread, a power of two. At 100 reports a
+ * second this holds well over a minute of a busy session. */
+#define RING_SIZE (1 << 22)
+
+static uint8_t ring[RING_SIZE];
+/* bytes ever put into the ring and written out of it, the ring position is
+ * taken modulo RING_SIZE. Only the main thread moves head and only the
+ * writer moves tail. */
+static uint64_t ring_head;
+static uint64_t ring_tail;
+static bool stopping;
+
+static bool active;
+static int log_fd = -1;
+static pthread_t writer;
+
+static struct input_source recorded_source;
+static input_clock recorded_clock;
+
+uint64_t session_log_dropped;
+uint64_t session_log_bytes;
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void ring_copy(uint64_t pos, void const *data, size_t len) {
+  size_t offset = pos % RING_SIZE;
+  size_t first = len < RING_SIZE - offset ? len : RING_SIZE - offset;
+
+  memcpy(ring + offset, data, first);
+  memcpy(ring, (uint8_t const *)data + first, len - first);
+}
+
+/* Never blocks the report loop, a record that doesn't fit is dropped */
+static void log_record(uint8_t type, void const *payload, size_t size) {
+  if (!active) {
+    return;
+  }
+
+  struct session_log_record record = {size, type, monotonic_ns()};
+  uint64_t head = ring_head;
+  uint64_t tail = __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE);
+  if (RING_SIZE - (head - tail) < sizeof record + size) {
+    session_log_dropped++;
+    return;
+  }
+
+  ring_copy(head, &record, sizeof record);
+  ring_copy(head + sizeof record, payload, size);
+  __atomic_store_n(&ring_head, head + sizeof record + size, __ATOMIC_RELEASE);
+}
+
+static bool write_all(uint8_t const *data, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(log_fd, data, len);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror(PROGRAM_NAME ": session log");
+      return false;
+    }
+    data += written;
+    len -= written;
+    session_log_bytes += written;
+  }
+  return true;
+}
+
+static void *writer_main(void *arg) {
+  for (;;) {
+    uint64_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring_tail;
+
+    if (head == tail) {
+      if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        break;
+      }
+      struct timespec pause = {0, 5000000};
+      nanosleep(&pause, NULL);
+      continue;
+    }
+
+    /* up to the end of the ring, the rest goes on the next round */
+    size_t offset = tail % RING_SIZE;
+    size_t len = head - tail;
+    if (len > RING_SIZE - offset) {
+      len = RING_SIZE - offset;
+    }
+    if (!write_all(ring + offset, len)) {
+      break;
+    }
+    __atomic_store_n(&ring_tail, tail + len, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+static bool recording_poll_event(struct input_event *event) {
+  if (!recorded_source.poll_event(event)) {
+    return false;
+  }
+  log_record(SESSION_LOG_EVENT, event, sizeof *event);
+  return true;
+}
+
+static void recording_clock(struct timeval *now) {
+  if (recorded_clock) {
+    recorded_clock(now);
+  } else {
+    gettimeofday(now, NULL);
+  }
+  log_record(SESSION_LOG_CLOCK, now, sizeof *now);
+}
+
+void session_log_open(char const *path, struct input_source *source,
+                      struct session_log_options const *options) {
+  log_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (log_fd < 0) {
+    perror(PROGRAM_NAME ": open");
+    exit(1);
+  }
+
+  struct session_log_header header = {SESSION_LOG_MAGIC, SESSION_LOG_VERSION,
+                                      sizeof(struct input_event), *options};
+  if (!write_all((uint8_t const *)&header, sizeof header)) {
+    exit(1);
+  }
+
+  recorded_source = *source;
+  source->poll_event = recording_poll_event;
+  recorded_clock = input_use_clock(recording_clock);
+
+  active = true;
+  if (pthread_create(&writer, NULL, writer_main, NULL)) {
+    printf(PROGRAM_NAME ": can't start the session log writer\n");
+    exit(1);
+  }
+
+  printf(PROGRAM_NAME ": recording the session to %s\n", path);
+}
+
+void session_log_close(void) {
+  if (!active) {
+    return;
+  }
+
+  active = false;
+  input_use_clock(recorded_clock);
+  __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+  pthread_join(writer, NULL);
+  close(log_fd);
+  log_fd = -1;
+}
+
+void session_log_update(void) { log_record(SESSION_LOG_UPDATE, NULL, 0); }
+
+void session_log_host(uint8_t const *buf, int len) {
+  log_record(SESSION_LOG_HOST, buf, len);
+}
+
+void session_log_build(bool drop_unchanged) {
+  uint8_t flag = drop_unchanged;
+  log_record(SESSION_LOG_BUILD, &flag, sizeof flag);
+}
+
+void session_log_report(uint8_t const *buf, int len) {
+  log_record(SESSION_LOG_REPORT, buf, len > 0 ? len : 0);
+}
+
+/* Replay reads the whole log into memory and walks it with replay_pos */
+static uint8_t *replay_data;
+static size_t replay_size;
+static size_t replay_pos;
+static struct timeval replay_time;
+static uint64_t replay_out_of_sequence;
+
+/* Reads the record at replay_pos without moving past it */
+static bool peek_record(struct session_log_record *record,
+                        uint8_t const **payload) {
+  if (replay_size - replay_pos < sizeof *record) {
+    return false;
+  }
+  memcpy(record, replay_data + replay_pos, sizeof *record);
+  if (replay_size - replay_pos - sizeof *record < record->size) {
+    return false; /* cut short while it was written */
+  }
+  *payload = replay_data + replay_pos + sizeof *record;
+  return true;
+}
+
+static void skip_record(struct session_log_record const *record) {
+  replay_pos += sizeof *record + record->size;
+}
+
+/* The recorded events of one input_update call come one after the other */
+static bool replay_poll_event(struct input_event *event) {
+  struct session_log_record record;
+  uint8_t const *payload;
+
+  if (!peek_record(&record, &payload) || record.type != SESSION_LOG_EVENT) {
+    return false;
+  }
+  memcpy(event, payload, sizeof *event);
+  skip_record(&record);
+  return true;
+}
+
+/* input.c reads the clock in the same order as it did while recording */
+static void replay_clock(struct timeval *now) {
+  struct session_log_record record;
+  uint8_t const *payload;
+
+  if (peek_record(&record, &payload) && record.type == SESSION_LOG_CLOCK &&
+      record.size == sizeof replay_time) {
+    memcpy(&replay_time, payload, sizeof replay_time);
+    skip_record(&record);
+  } else {
+    replay_out_of_sequence++;
+  }
+  *now = replay_time;
+}
+
+static void print_bytes(char const *label, uint8_t const *buf, int len) {
+  printf("  %s", label);
+  for (int i = 0; i < len; i++) {
+    printf(" %02x", buf[i]);
+  }
+  printf("\n");
+}
+
+/* Runs one BUILD record: builds the report as the emulator loop does and
+ * compares it with the REPORT record that follows. Returns false on a
+ * mismatch. */
+static bool replay_build(struct wiimote_state *state, uint8_t const *flag,
+                         size_t size, uint64_t index) {
+  uint8_t buf[256];
+
+  state->sys.drop_unchanged = size > 0 && flag[0];
+  input_prepare_report(state);
+  int len = generate_report(state, buf);
+  if (state->sys.data_report && len > 0) {
+    input_report_sent();
+  }
+  if (state->sys.data_turn) {
+    input_report_turn();
+  }
+  if (len < 0) {
+    len = 0;
+  }
+
+  struct session_log_record record;
+  uint8_t const *expected;
+  if (!peek_record(&record, &expected) ||
+      record.type != SESSION_LOG_REPORT) {
+    replay_out_of_sequence++;
+    return false;
+  }
+  skip_record(&record);
+
+  if (record.size == len && memcmp(buf, expected, len) == 0) {
+    return true;
+  }
+  printf(PROGRAM_NAME ": report %llu differs\n", (unsigned long long)index);
+  print_bytes("recorded:", expected, record.size);
+  print_bytes("replayed:", buf, len);
+  return false;
+}
+
+/* Prints options the way they're given on the command line */
+static void print_options(char const *label,
+                          struct session_log_options const *options) {
+  printf("  %s -q %d", label, options->queue_interleave_ratio);
+  if (options->pointer_filter) {
+    printf(" -f %g,%g,%g,%g", options->filter[0], options->filter[1],
+           options->filter[2], options->filter[3]);
+  }
+  if (options->interpolation) {
+    printf(" -i %g,%g", options->interp[0], options->interp[1]);
+  }
+  if (options->raw_ir) {
+    printf(" -r");
+  }
+  if (options->ir_table) {
+    printf(" -t");
+  }
+  printf("\n");
+}
+
+int session_replay(char const *path, bool fast,
+                   struct session_log_options const *options) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    perror(PROGRAM_NAME ": fopen");
+    return -1;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+
+  struct session_log_header header;
+  replay_data = malloc(size > 0 ? size : 1);
+  replay_size = size;
+  if (size < (long)sizeof header ||
+      fread(replay_data, 1, size, file) != (size_t)size) {
+    printf(PROGRAM_NAME ": can't read session log %s\n", path);
+    fclose(file);
+    free(replay_data);
+    return -1;
+  }
+  fclose(file);
+
+  memcpy(&header, replay_data, sizeof header);
+  if (header.magic != SESSION_LOG_MAGIC ||
+      header.version != SESSION_LOG_VERSION ||
+      header.event_size != sizeof(struct input_event)) {
+    printf(PROGRAM_NAME ": %s isn't a session log of this build\n", path);
+    free(replay_data);
+    return -1;
+  }
+  if (memcmp(&header.options, options, sizeof *options) != 0) {
+    printf(PROGRAM_NAME ": %s was recorded with other options\n", path);
+    print_options("recorded:", &header.options);
+    print_options("given:   ", options);
+    free(replay_data);
+    return -1;
+  }
+  replay_pos = sizeof header;
+
+  struct wiimote_state state;
+  wiimote_init(&state);
+  struct input_source source = {.poll_event = replay_poll_event};
+  input_clock previous_clock = input_use_clock(replay_clock);
+
+  uint64_t reports = 0, mismatches = 0, updates = 0, host_reports = 0;
+  uint64_t start = monotonic_ns(), first_ns = 0;
+  struct session_log_record record;
+  uint8_t const *payload;
+
+  while (peek_record(&record, &payload)) {
+    if (!fast) {
+      /* at the recorded pace, relative to the first record */
+      if (first_ns == 0) {
+        first_ns = record.ns;
+      }
+      uint64_t due = start + (record.ns - first_ns), now = monotonic_ns();
+      if (due > now) {
+        struct timespec pause = {(due - now) / 1000000000,
+                                 (due - now) % 1000000000};
+        nanosleep(&pause, NULL);
+      }
+    }
+    skip_record(&record);
+
+    switch (record.type) {
+    case SESSION_LOG_UPDATE:
+      input_update(&state, &source);
+      updates++;
+      break;
+    case SESSION_LOG_HOST:
+      process_report(&state, payload, record.size);
+      host_reports++;
+      break;
+    case SESSION_LOG_BUILD:
+      if (!replay_build(&state, payload, record.size, reports)) {
+        mismatches++;
+      }
+      reports++;
+      break;
+    default:
+      replay_out_of_sequence++;
+      break;
+    }
+  }
+
+  double seconds = (monotonic_ns() - start) / 1e9;
+  printf(PROGRAM_NAME ": replayed %llu reports, %llu input updates and %llu "
+                      "reports from the Wii in %.3f s (%.0f reports/s)\n",
+         (unsigned long long)reports, (unsigned long long)updates,
+         (unsigned long long)host_reports, seconds,
+         seconds > 0 ? reports / seconds : 0);
+  printf(PROGRAM_NAME ": %llu reports differ, %llu records out of sequence\n",
+         (unsigned long long)mismatches,
+         (unsigned long long)replay_out_of_sequence);
+
+  input_use_clock(previous_clock);
+  wiimote_destroy(&state);
+  free(replay_data);
+  return mismatches + replay_out_of_sequence;
+}
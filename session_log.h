@@ -0,0 +1,77 @@
+#ifndef SESSION_LOG_H
+#define SESSION_LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "input.h"
+#include "wiimote.h"
+
+#define SESSION_LOG_MAGIC 0x574d524c /* "WMRL" */
+#define SESSION_LOG_VERSION 2
+
+/* The command line options that change the reports built, as given. A log
+ * only replays with the same ones. */
+struct session_log_options {
+  int32_t queue_interleave_ratio; /* -q */
+  uint8_t raw_ir;                 /* -r */
+  uint8_t ir_table;               /* -t */
+  uint8_t pointer_filter;         /* -f given, with its four values */
+  uint8_t interpolation;          /* -i given, with its two values */
+  double filter[4];
+  double interp[2];
+} __attribute__((packed));
+
+/* A session log is this header followed by records until the end of the
+ * file, everything in the byte order of the machine that wrote it. Input
+ * events are stored as struct input_event, so a log replays with the build
+ * that recorded it (event_size is checked). */
+struct session_log_header {
+  uint32_t magic;      /* SESSION_LOG_MAGIC */
+  uint16_t version;    /* SESSION_LOG_VERSION */
+  uint16_t event_size; /* sizeof(struct input_event) */
+  struct session_log_options options;
+} __attribute__((packed));
+
+/* Each record is this, then size bytes of payload */
+struct session_log_record {
+  uint16_t size;
+  uint8_t type; /* enum session_log_record_type */
+  uint64_t ns;  /* CLOCK_MONOTONIC when it was logged */
+} __attribute__((packed));
+
+enum session_log_record_type {
+  SESSION_LOG_UPDATE = 1, /* input_update is called */
+  SESSION_LOG_EVENT,      /* struct input_event the input source returned */
+  SESSION_LOG_CLOCK,      /* struct timeval the input clock returned */
+  SESSION_LOG_HOST,       /* output report from the Wii, to process_report */
+  SESSION_LOG_BUILD,      /* a report is built, one byte drop_unchanged */
+  SESSION_LOG_REPORT,     /* the report generate_report built, may be empty */
+};
+
+/* Starts recording to path, noting the options in effect. Input events
+ * polled from *source are logged by replacing it with a recording source,
+ * and the input clock readings by wrapping the current clock. Records are
+ * copied into a ring buffer and a background thread writes them out. */
+void session_log_open(char const *path, struct input_source *source,
+                      struct session_log_options const *options);
+/* Writes out what's left and puts the clock back */
+void session_log_close(void);
+
+void session_log_update(void);
+void session_log_host(uint8_t const *buf, int len);
+void session_log_build(bool drop_unchanged);
+void session_log_report(uint8_t const *buf, int len);
+
+/* records dropped because the ring buffer was full, and bytes written */
+extern uint64_t session_log_dropped;
+extern uint64_t session_log_bytes;
+
+/* Feeds a log back through input_update, process_report and
+ * generate_report, as fast as possible or at the recorded pace, and
+ * compares each report with the recorded one. Returns the number of
+ * mismatches, or -1 if the log can't be read or was recorded with other
+ * options. */
+int session_replay(char const *path, bool fast,
+                   struct session_log_options const *options);
+
+#endif
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "vector_math.h"
+#include "vector_math_simd.h"
+
+/* Compares the float routines of vector_math_simd.h with the double ones of
+ * vector_math.h on the sensor bar projection done by set_motion_state, then
+ * times both. Constants are the ones in motion.c. */
+
+#define ITERATIONS 1000000
+#define GRID 64
+
+static const double screen_distance = 2;
+static const double screen_width = 1.0;
+static const double sensor_bar_y = 1.0 / (4.0 / 3.0) * 0.5;
+static const double sensor_bar_width = 0.20;
+
+static const double cam_aspect = 1024.0 / 768.0;
+static const double cam_fov = 42.0;
+static const double cam_far = 4.0;
+static const double cam_near = 0.5;
+
+static void make_projection(mat4 *proj_mat) {
+  double top = cam_near * tan(cam_fov / 180.0 * M_PI * 0.5);
+  double height = 2.0 * top;
+  double width = cam_aspect * height;
+  double left = -0.5 * width;
+  double right = left + width;
+  double bottom = top - height;
+
+  proj_mat->v0 = (vec4){2.0 * cam_near / (right - left), 0.0, 0.0, 0.0};
+  proj_mat->v1 = (vec4){0.0, 2.0 * cam_near / (top - bottom), 0.0, 0.0};
+  proj_mat->v2 = (vec4){(right + left) / (right - left),
+                        (top + bottom) / (top - bottom),
+                        -(cam_far + cam_near) / (cam_far - cam_near), -1.0};
+  proj_mat->v3 =
+      (vec4){0.0, 0.0, -2.0 * cam_far * cam_near / (cam_far - cam_near), 0.0};
+}
+
+static void project_double(const mat4 *proj_mat, double pointer_x,
+                           double pointer_y, vec4 out[2]) {
+  vec3 dir = {(pointer_x - 0.5) * screen_width, pointer_y * screen_width,
+              -screen_distance};
+  vec3_normalize(&dir);
+
+  vec3 up = {0.0, 1.0, 0.0};
+  vec3 z = {-dir.x, -dir.y, -dir.z};
+  vec3 x, y;
+  vec3_cross(&x, &up, &z);
+  vec3_normalize(&x);
+  vec3_cross(&y, &z, &x);
+
+  mat4 view_mat;
+  view_mat.v0 = (vec4){x.x, x.y, x.z, 0.0};
+  view_mat.v1 = (vec4){y.x, y.y, y.z, 0.0};
+  view_mat.v2 = (vec4){z.x, z.y, z.z, 0.0};
+  view_mat.v3 = (vec4){0.0, 0.0, 0.0, 1.0};
+  mat4_invert(&view_mat);
+
+  mat4 model_mat;
+  vec3 model_pos = {0.0, sensor_bar_y, -screen_distance};
+  mat4_make_translation(&model_mat, &model_pos);
+
+  mat4 mvp = *proj_mat;
+  mat4_mult(&view_mat, &model_mat);
+  mat4_mult(&mvp, &view_mat);
+
+  out[0] = (vec4){-sensor_bar_width * 0.5, 0.0, 0.0, 1.0};
+  out[1] = (vec4){sensor_bar_width * 0.5, 0.0, 0.0, 1.0};
+  for (int i = 0; i < 2; i++) {
+    vec4_apply_mat4(&out[i], &mvp);
+    vec4_multiply_scalar(&out[i], 1 / out[i].w);
+    vec4_add_scalar(&out[i], 1.0);
+    vec4_multiply_scalar(&out[i], 0.5);
+  }
+}
+
+static void project_float(const mat4f *proj_mat, float pointer_x,
+                          float pointer_y, vec4f out[2]) {
+  vec3f dir = {(pointer_x - 0.5f) * (float)screen_width,
+               pointer_y * (float)screen_width, -(float)screen_distance, 0.0f};
+  vec3f_normalize(&dir);
+
+  vec3f up = {0.0f, 1.0f, 0.0f, 0.0f};
+  vec3f z = -dir;
+  vec3f x, y;
+  vec3f_cross(&x, &up, &z);
+  vec3f_normalize(&x);
+  vec3f_cross(&y, &z, &x);
+
+  mat4f view_mat = {x, y, z, {0.0f, 0.0f, 0.0f, 1.0f}};
+  mat4f_invert(&view_mat);
+
+  mat4f model_mat;
+  vec3f model_pos = {0.0f, sensor_bar_y, -screen_distance, 0.0f};
+  mat4f_make_translation(&model_mat, &model_pos);
+
+  mat4f mvp = *proj_mat;
+  mat4f_mult(&view_mat, &model_mat);
+  mat4f_mult(&mvp, &view_mat);
+
+  out[0] = (vec4f){-sensor_bar_width * 0.5, 0.0f, 0.0f, 1.0f};
+  out[1] = (vec4f){sensor_bar_width * 0.5, 0.0f, 0.0f, 1.0f};
+  vec4f_project_mat4f(&out[0], &mvp);
+  vec4f_project_mat4f(&out[1], &mvp);
+}
+
+static double elapsed(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  mat4 proj_mat;
+  make_projection(&proj_mat);
+  mat4f proj_matf;
+  mat4f_from_mat4(&proj_matf, &proj_mat);
+
+  /* accuracy over the pointer range, in IR camera pixels */
+  double max_error = 0;
+  int pixel_mismatches = 0;
+  for (int i = 0; i <= GRID; i++) {
+    for (int j = 0; j <= GRID; j++) {
+      double px = -0.5 + 2.0 * i / GRID, py = -0.5 + 2.0 * j / GRID;
+      vec4 ref[2];
+      vec4f out[2];
+      project_double(&proj_mat, px, py, ref);
+      project_float(&proj_matf, px, py, out);
+
+      for (int k = 0; k < 2; k++) {
+        double dx = fabs(ref[k].x - out[k][0]) * 1023;
+        double dy = fabs(ref[k].y - out[k][1]) * 767;
+        max_error = fmax(max_error, fmax(dx, dy));
+        if (round(ref[k].x * 1023) != round(out[k][0] * 1023) ||
+            round(ref[k].y * 767) != round(out[k][1] * 767)) {
+          pixel_mismatches++;
+        }
+      }
+    }
+  }
+  printf("Max error: %g pixels, %d of %d rounded dots differ\n", max_error,
+         pixel_mismatches, 2 * (GRID + 1) * (GRID + 1));
+
+  /* a general (non rigid) inverse, checked against the double one */
+  mat4 m = {{2, 0.5, 0.1, 0}, {0.3, 1.5, -0.2, 0.1}, {0, 0.4, 3, -1},
+            {1, -2, 0.5, 1}};
+  mat4f mf;
+  mat4f_from_mat4(&mf, &m);
+  mat4_invert(&m);
+  mat4f_invert(&mf);
+  double max_inverse_error = 0;
+  vec4 *cols = &m.v0;
+  vec4f *colsf = &mf.v0;
+  for (int i = 0; i < 4; i++) {
+    max_inverse_error = fmax(max_inverse_error, fabs(cols[i].x - colsf[i][0]));
+    max_inverse_error = fmax(max_inverse_error, fabs(cols[i].y - colsf[i][1]));
+    max_inverse_error = fmax(max_inverse_error, fabs(cols[i].z - colsf[i][2]));
+    max_inverse_error = fmax(max_inverse_error, fabs(cols[i].w - colsf[i][3]));
+  }
+  printf("Max mat4 inverse error: %g\n", max_inverse_error);
+
+  /* speed, inputs vary so nothing is hoisted out of the loop */
+  struct timespec start;
+  volatile double sink = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < ITERATIONS; i++) {
+    vec4 out[2];
+    project_double(&proj_mat, (i & 1023) / 1024.0, (i >> 10 & 1023) / 1024.0,
+                   out);
+    sink += out[0].x + out[1].y;
+  }
+  double double_time = elapsed(&start);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < ITERATIONS; i++) {
+    vec4f out[2];
+    project_float(&proj_matf, (i & 1023) / 1024.0f, (i >> 10 & 1023) / 1024.0f,
+                  out);
+    sink += out[0][0] + out[1][1];
+  }
+  double float_time = elapsed(&start);
+
+  printf("double: %.1f ns per projection\n", double_time * 1e9 / ITERATIONS);
+  printf("float:  %.1f ns per projection (%.1fx)\n",
+         float_time * 1e9 / ITERATIONS, double_time / float_time);
+
+  return max_error < 0.01 && max_inverse_error < 1e-5 ? 0 : 1;
+}
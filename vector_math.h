@@ -36,12 +36,20 @@ typedef struct
   vec4 v3;
 } mat4;
 
-double vec3_len(const vec3 * vec)
+typedef struct
+{
+  double w;
+  double x;
+  double y;
+  double z;
+} quat;
+
+static inline double vec3_len(const vec3 * vec)
 {
   return sqrt(vec->x * vec->x + vec->y * vec->y + vec->z * vec->z);
 }
 
-void vec3_normalize(vec3 * vec)
+static inline void vec3_normalize(vec3 * vec)
 {
   double len = vec3_len(vec);
   vec->x /= len;
@@ -49,14 +57,14 @@ void vec3_normalize(vec3 * vec)
   vec->z /= len;
 }
 
-void vec3_cross(vec3 * out, const vec3 * first, const vec3 * second)
+static inline void vec3_cross(vec3 * out, const vec3 * first, const vec3 * second)
 {
   out->x = first->y * second->z - first->z * second->y;
   out->y = first->z * second->x - first->x * second->z;
   out->z = first->x * second->y - first->y * second->x;
 }
 
-void mat4_make_translation(mat4 * mat, const vec3 * translate)
+static inline void mat4_make_translation(mat4 * mat, const vec3 * translate)
 {
   mat->v0 = (vec4){ 1.0, 0.0, 0.0, 0.0 };
   mat->v1 = (vec4){ 0.0, 1.0, 0.0, 0.0 };
@@ -64,7 +72,7 @@ void mat4_make_translation(mat4 * mat, const vec3 * translate)
   mat->v3 = (vec4){ translate->x, translate->y, translate->z, 1.0 };
 }
 
-void mat4_mult(mat4 * a, const mat4 * b)
+static inline void mat4_mult(mat4 * a, const mat4 * b)
 {
   double a11 = a->v0.x, a12 = a->v1.x, a13 = a->v2.x, a14 = a->v3.x;
   double a21 = a->v0.y, a22 = a->v1.y, a23 = a->v2.y, a24 = a->v3.y;
@@ -97,7 +105,7 @@ void mat4_mult(mat4 * a, const mat4 * b)
   a->v3.w = a41 * b14 + a42 * b24 + a43 * b34 + a44 * b44;
 }
 
-void mat4_invert(mat4 * m)
+static inline void mat4_invert(mat4 * m)
 {
   double n11 = m->v0.x, n21 = m->v0.y, n31 = m->v0.z, n41 = m->v0.w,
     n12 = m->v1.x, n22 = m->v1.y, n32 = m->v1.z, n42 = m->v1.w,
@@ -139,7 +147,7 @@ void mat4_invert(mat4 * m)
   m->v3.w = (n12 * n23 * n31 - n13 * n22 * n31 + n13 * n21 * n32 - n11 * n23 * n32 - n12 * n21 * n33 + n11 * n22 * n33) * detInv;
 }
 
-void vec4_apply_mat4(vec4 * vec, const mat4 * mat)
+static inline void vec4_apply_mat4(vec4 * vec, const mat4 * mat)
 {
   double x = vec->x, y = vec->y, z = vec->z, w = vec->w;
 
@@ -149,7 +157,7 @@ void vec4_apply_mat4(vec4 * vec, const mat4 * mat)
   vec->w = mat->v0.w * x + mat->v1.w * y + mat->v2.w * z + mat->v3.w * w;
 }
 
-void vec3_apply_mat3(vec3 * vec, const mat3 * mat)
+static inline void vec3_apply_mat3(vec3 * vec, const mat3 * mat)
 {
   double x = vec->x, y = vec->y, z = vec->z;
 
@@ -158,7 +166,7 @@ void vec3_apply_mat3(vec3 * vec, const mat3 * mat)
   vec->z = mat->v0.z * x + mat->v1.z * y + mat->v2.z * z;
 }
 
-void vec4_multiply_scalar(vec4 * vec, double scalar)
+static inline void vec4_multiply_scalar(vec4 * vec, double scalar)
 {
   vec->x *= scalar;
   vec->y *= scalar;
@@ -166,7 +174,7 @@ void vec4_multiply_scalar(vec4 * vec, double scalar)
   vec->w *= scalar;
 }
 
-void vec4_add_scalar(vec4 * vec, double scalar)
+static inline void vec4_add_scalar(vec4 * vec, double scalar)
 {
   vec->x += scalar;
   vec->y += scalar;
@@ -174,21 +182,21 @@ void vec4_add_scalar(vec4 * vec, double scalar)
   vec->w += scalar;
 }
 
-void vec3_multiply_scalar(vec3 * vec, double scalar)
+static inline void vec3_multiply_scalar(vec3 * vec, double scalar)
 {
   vec->x *= scalar;
   vec->y *= scalar;
   vec->z *= scalar;
 }
 
-void vec3_add_scalar(vec3 * vec, double scalar)
+static inline void vec3_add_scalar(vec3 * vec, double scalar)
 {
   vec->x += scalar;
   vec->y += scalar;
   vec->z += scalar;
 }
 
-void mat3_invert(mat3 * m)
+static inline void mat3_invert(mat3 * m)
 {
   double n11 = m->v0.x, n21 = m->v0.y, n31 = m->v0.z,
     n12 = m->v1.x, n22 = m->v1.y, n32 = m->v1.z,
@@ -220,7 +228,7 @@ void mat3_invert(mat3 * m)
   m->v2.z = (n22 * n11 - n21 * n12) * detInv;
 }
 
-void mat3_transpose(mat3 * m)
+static inline void mat3_transpose(mat3 * m)
 {
   double tmp;
   tmp = m->v0.y; m->v0.y = m->v1.x; m->v1.x = tmp;
@@ -228,31 +236,151 @@ void mat3_transpose(mat3 * m)
   tmp = m->v1.z; m->v1.z = m->v2.y; m->v2.y = tmp;
 }
 
-void mat3_from_mat4(mat3 * out, const mat4 * mat)
+static inline void mat3_from_mat4(mat3 * out, const mat4 * mat)
 {
   out->v0 = (vec3){ mat->v0.x, mat->v0.y, mat->v0.z };
   out->v1 = (vec3){ mat->v1.x, mat->v1.y, mat->v1.z };
   out->v2 = (vec3){ mat->v2.x, mat->v2.y, mat->v2.z };
 }
 
-void vec3_print(const vec3 * vec)
+static inline void quat_mult(quat * out, const quat * a, const quat * b)
+{
+  quat r;
+  r.w = a->w * b->w - a->x * b->x - a->y * b->y - a->z * b->z;
+  r.x = a->w * b->x + a->x * b->w + a->y * b->z - a->z * b->y;
+  r.y = a->w * b->y - a->x * b->z + a->y * b->w + a->z * b->x;
+  r.z = a->w * b->z + a->x * b->y - a->y * b->x + a->z * b->w;
+  *out = r;
+}
+
+static inline void quat_conjugate(quat * q)
+{
+  q->x = -q->x;
+  q->y = -q->y;
+  q->z = -q->z;
+}
+
+static inline void quat_normalize(quat * q)
+{
+  double len = sqrt(q->w * q->w + q->x * q->x + q->y * q->y + q->z * q->z);
+  q->w /= len;
+  q->x /= len;
+  q->y /= len;
+  q->z /= len;
+}
+
+//rotation part of mat, which must be orthonormal
+static inline void quat_from_mat4(quat * q, const mat4 * mat)
+{
+  double m00 = mat->v0.x, m11 = mat->v1.y, m22 = mat->v2.z;
+  double trace = m00 + m11 + m22;
+
+  //pick the largest component to divide by, for precision
+  if (trace > 0)
+  {
+    double s = 2.0 * sqrt(trace + 1.0);
+    q->w = 0.25 * s;
+    q->x = (mat->v1.z - mat->v2.y) / s;
+    q->y = (mat->v2.x - mat->v0.z) / s;
+    q->z = (mat->v0.y - mat->v1.x) / s;
+  }
+  else if (m00 > m11 && m00 > m22)
+  {
+    double s = 2.0 * sqrt(1.0 + m00 - m11 - m22);
+    q->w = (mat->v1.z - mat->v2.y) / s;
+    q->x = 0.25 * s;
+    q->y = (mat->v1.x + mat->v0.y) / s;
+    q->z = (mat->v2.x + mat->v0.z) / s;
+  }
+  else if (m11 > m22)
+  {
+    double s = 2.0 * sqrt(1.0 + m11 - m00 - m22);
+    q->w = (mat->v2.x - mat->v0.z) / s;
+    q->x = (mat->v1.x + mat->v0.y) / s;
+    q->y = 0.25 * s;
+    q->z = (mat->v2.y + mat->v1.z) / s;
+  }
+  else
+  {
+    double s = 2.0 * sqrt(1.0 + m22 - m00 - m11);
+    q->w = (mat->v0.y - mat->v1.x) / s;
+    q->x = (mat->v2.x + mat->v0.z) / s;
+    q->y = (mat->v2.y + mat->v1.z) / s;
+    q->z = 0.25 * s;
+  }
+}
+
+//rotates vec by the unit quaternion q, without building a matrix
+static inline void vec3_rotate_quat(vec3 * vec, const quat * q)
+{
+  vec3 u = { q->x, q->y, q->z };
+  vec3 t;
+  vec3_cross(&t, &u, vec);
+  vec3_multiply_scalar(&t, 2.0);
+
+  vec3 ut;
+  vec3_cross(&ut, &u, &t);
+
+  vec->x += q->w * t.x + ut.x;
+  vec->y += q->w * t.y + ut.y;
+  vec->z += q->w * t.z + ut.z;
+}
+
+//turns q by the body angular rates (radians/second) over dt seconds
+static inline void quat_integrate(quat * q, const vec3 * rates, double dt)
+{
+  double angle = vec3_len(rates) * dt;
+  if (angle == 0)
+  {
+    return;
+  }
+
+  double s = sin(angle * 0.5) / vec3_len(rates);
+  quat step = { cos(angle * 0.5), rates->x * s, rates->y * s, rates->z * s };
+
+  quat_mult(q, q, &step);
+  quat_normalize(q);
+}
+
+//body angular rates (radians/second) turning from into to over dt seconds
+static inline void quat_rates(vec3 * rates, const quat * from, const quat * to, double dt)
+{
+  quat delta = *from;
+  quat_conjugate(&delta);
+  quat_mult(&delta, &delta, to);
+
+  //q and -q are the same orientation, take the short way round
+  if (delta.w < 0)
+  {
+    delta = (quat){ -delta.w, -delta.x, -delta.y, -delta.z };
+  }
+
+  vec3 axis = { delta.x, delta.y, delta.z };
+  double len = vec3_len(&axis);
+  double scale = len > 1e-9 ? 2.0 * atan2(len, delta.w) / len : 2.0;
+
+  *rates = axis;
+  vec3_multiply_scalar(rates, scale / dt);
+}
+
+static inline void vec3_print(const vec3 * vec)
 {
   printf("%f %f %f\n", vec->x, vec->y, vec->z);
 }
 
-void vec4_print(const vec4 * vec)
+static inline void vec4_print(const vec4 * vec)
 {
   printf("%f %f %f %f\n", vec->x, vec->y, vec->z, vec->w);
 }
 
-void mat3_print(const mat3 * mat)
+static inline void mat3_print(const mat3 * mat)
 {
   printf("%f %f %f\n", mat->v0.x, mat->v1.x, mat->v2.x);
   printf("%f %f %f\n", mat->v0.y, mat->v1.y, mat->v2.y);
   printf("%f %f %f\n", mat->v0.z, mat->v1.z, mat->v2.z);
 }
 
-void mat4_print(const mat4 * mat)
+static inline void mat4_print(const mat4 * mat)
 {
   printf("%f %f %f %f\n", mat->v0.x, mat->v1.x, mat->v2.x, mat->v3.x);
   printf("%f %f %f %f\n", mat->v0.y, mat->v1.y, mat->v2.y, mat->v3.y);
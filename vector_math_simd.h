@@ -0,0 +1,259 @@
+#ifndef VECTOR_MATH_SIMD_H
+#define VECTOR_MATH_SIMD_H
+
+// Single precision counterpart of vector_math.h. Vectors are four float
+// lanes, so the compiler maps them onto NEON or SSE registers, and matrices
+// are stored as columns like mat4. A vec3f keeps its w lane at zero.
+
+#include <math.h>
+
+#include "vector_math.h"
+
+typedef float vec4f __attribute__((vector_size(16)));
+typedef int vec4i __attribute__((vector_size(16)));
+typedef vec4f vec3f;
+
+typedef struct
+{
+  vec3f v0;
+  vec3f v1;
+  vec3f v2;
+} mat3f;
+
+typedef struct
+{
+  vec4f v0;
+  vec4f v1;
+  vec4f v2;
+  vec4f v3;
+} mat4f;
+
+#if defined(__clang__)
+#define VEC4F_SHUFFLE(vec, a, b, c, d) __builtin_shufflevector(vec, vec, a, b, c, d)
+#else
+#define VEC4F_SHUFFLE(vec, a, b, c, d) __builtin_shuffle(vec, (vec4i){ a, b, c, d })
+#endif
+
+static inline vec4f vec4f_splat(float scalar)
+{
+  return (vec4f){ scalar, scalar, scalar, scalar };
+}
+
+static inline float vec3f_dot(vec3f first, vec3f second)
+{
+  vec4f prod = first * second;
+  return prod[0] + prod[1] + prod[2];
+}
+
+static inline float vec3f_len(const vec3f * vec)
+{
+  return sqrtf(vec3f_dot(*vec, *vec));
+}
+
+static inline void vec3f_normalize(vec3f * vec)
+{
+  *vec *= vec4f_splat(1.0f / vec3f_len(vec));
+}
+
+static inline void vec3f_cross(vec3f * out, const vec3f * first, const vec3f * second)
+{
+  vec4f a = *first, b = *second;
+  *out = VEC4F_SHUFFLE(a, 1, 2, 0, 3) * VEC4F_SHUFFLE(b, 2, 0, 1, 3) -
+         VEC4F_SHUFFLE(a, 2, 0, 1, 3) * VEC4F_SHUFFLE(b, 1, 2, 0, 3);
+}
+
+static inline void mat4f_make_translation(mat4f * mat, const vec3f * translate)
+{
+  mat->v0 = (vec4f){ 1.0f, 0.0f, 0.0f, 0.0f };
+  mat->v1 = (vec4f){ 0.0f, 1.0f, 0.0f, 0.0f };
+  mat->v2 = (vec4f){ 0.0f, 0.0f, 1.0f, 0.0f };
+  mat->v3 = *translate;
+  mat->v3[3] = 1.0f;
+}
+
+static inline vec4f mat4f_apply(const mat4f * mat, vec4f vec)
+{
+  return mat->v0 * vec4f_splat(vec[0]) + mat->v1 * vec4f_splat(vec[1]) +
+         mat->v2 * vec4f_splat(vec[2]) + mat->v3 * vec4f_splat(vec[3]);
+}
+
+static inline void mat4f_mult(mat4f * a, const mat4f * b)
+{
+  mat4f m = *a;
+
+  a->v0 = mat4f_apply(&m, b->v0);
+  a->v1 = mat4f_apply(&m, b->v1);
+  a->v2 = mat4f_apply(&m, b->v2);
+  a->v3 = mat4f_apply(&m, b->v3);
+}
+
+static inline void mat4f_transpose(mat4f * m)
+{
+  vec4f c0 = m->v0, c1 = m->v1, c2 = m->v2, c3 = m->v3;
+
+  m->v0 = (vec4f){ c0[0], c1[0], c2[0], c3[0] };
+  m->v1 = (vec4f){ c0[1], c1[1], c2[1], c3[1] };
+  m->v2 = (vec4f){ c0[2], c1[2], c2[2], c3[2] };
+  m->v3 = (vec4f){ c0[3], c1[3], c2[3], c3[3] };
+}
+
+// Inverse from the cross products of the upper three rows, see Lengyel,
+// Foundations of Game Engine Development, vol. 1, section 1.7.5.
+static inline void mat4f_invert(mat4f * m)
+{
+  vec4f a = m->v0, b = m->v1, c = m->v2, d = m->v3;
+  float x = a[3], y = b[3], z = c[3], w = d[3];
+
+  vec3f s, t;
+  vec3f_cross(&s, &a, &b);
+  vec3f_cross(&t, &c, &d);
+  vec3f u = a * vec4f_splat(y) - b * vec4f_splat(x);
+  vec3f v = c * vec4f_splat(w) - d * vec4f_splat(z);
+
+  float det = vec3f_dot(s, v) + vec3f_dot(t, u);
+
+  if (det == 0)
+  {
+    return;
+  }
+
+  vec4f detInv = vec4f_splat(1 / det);
+  s *= detInv;
+  t *= detInv;
+  u *= detInv;
+  v *= detInv;
+
+  vec3f r0, r1, r2, r3;
+  vec3f_cross(&r0, &b, &v);
+  vec3f_cross(&r1, &v, &a);
+  vec3f_cross(&r2, &d, &u);
+  vec3f_cross(&r3, &u, &c);
+
+  m->v0 = r0 + t * vec4f_splat(y);
+  m->v1 = r1 - t * vec4f_splat(x);
+  m->v2 = r2 + s * vec4f_splat(w);
+  m->v3 = r3 - s * vec4f_splat(z);
+  m->v0[3] = -vec3f_dot(b, t);
+  m->v1[3] = vec3f_dot(a, t);
+  m->v2[3] = -vec3f_dot(d, s);
+  m->v3[3] = vec3f_dot(c, s);
+
+  // the rows were built above, the result is stored as columns
+  mat4f_transpose(m);
+}
+
+static inline void vec4f_apply_mat4f(vec4f * vec, const mat4f * mat)
+{
+  *vec = mat4f_apply(mat, *vec);
+}
+
+static inline void vec3f_apply_mat3f(vec3f * vec, const mat3f * mat)
+{
+  vec4f v = *vec;
+  *vec = mat->v0 * vec4f_splat(v[0]) + mat->v1 * vec4f_splat(v[1]) +
+         mat->v2 * vec4f_splat(v[2]);
+}
+
+// Fused model-view-projection of a point: transform, perspective divide and
+// map from clip space to 0..1, as the IR camera sees it.
+static inline void vec4f_project_mat4f(vec4f * vec, const mat4f * mvp)
+{
+  vec4f clip = mat4f_apply(mvp, *vec);
+  vec4f half = vec4f_splat(0.5f);
+
+  *vec = clip * vec4f_splat(0.5f / clip[3]) + half;
+}
+
+static inline void vec4f_multiply_scalar(vec4f * vec, float scalar)
+{
+  *vec *= vec4f_splat(scalar);
+}
+
+static inline void vec4f_add_scalar(vec4f * vec, float scalar)
+{
+  *vec += vec4f_splat(scalar);
+}
+
+static inline void vec3f_multiply_scalar(vec3f * vec, float scalar)
+{
+  *vec *= (vec4f){ scalar, scalar, scalar, 0.0f };
+}
+
+static inline void vec3f_add_scalar(vec3f * vec, float scalar)
+{
+  *vec += (vec4f){ scalar, scalar, scalar, 0.0f };
+}
+
+static inline void mat3f_transpose(mat3f * m)
+{
+  vec3f c0 = m->v0, c1 = m->v1, c2 = m->v2;
+
+  m->v0 = (vec3f){ c0[0], c1[0], c2[0], 0.0f };
+  m->v1 = (vec3f){ c0[1], c1[1], c2[1], 0.0f };
+  m->v2 = (vec3f){ c0[2], c1[2], c2[2], 0.0f };
+}
+
+static inline void mat3f_invert(mat3f * m)
+{
+  vec3f r0, r1, r2;
+  vec3f_cross(&r0, &m->v1, &m->v2);
+  vec3f_cross(&r1, &m->v2, &m->v0);
+  vec3f_cross(&r2, &m->v0, &m->v1);
+
+  float det = vec3f_dot(m->v0, r0);
+
+  if (det == 0)
+  {
+    return;
+  }
+
+  vec4f detInv = vec4f_splat(1 / det);
+  m->v0 = r0 * detInv;
+  m->v1 = r1 * detInv;
+  m->v2 = r2 * detInv;
+
+  // rows of the inverse, stored as columns
+  mat3f_transpose(m);
+}
+
+static inline void mat3f_from_mat4f(mat3f * out, const mat4f * mat)
+{
+  vec4f mask = { 1.0f, 1.0f, 1.0f, 0.0f };
+
+  out->v0 = mat->v0 * mask;
+  out->v1 = mat->v1 * mask;
+  out->v2 = mat->v2 * mask;
+}
+
+static inline vec4f vec4f_from_vec4(const vec4 * vec)
+{
+  return (vec4f){ vec->x, vec->y, vec->z, vec->w };
+}
+
+static inline vec3f vec3f_from_vec3(const vec3 * vec)
+{
+  return (vec3f){ vec->x, vec->y, vec->z, 0.0f };
+}
+
+static inline void mat4f_from_mat4(mat4f * out, const mat4 * mat)
+{
+  out->v0 = vec4f_from_vec4(&mat->v0);
+  out->v1 = vec4f_from_vec4(&mat->v1);
+  out->v2 = vec4f_from_vec4(&mat->v2);
+  out->v3 = vec4f_from_vec4(&mat->v3);
+}
+
+static inline void vec4f_print(const vec4f * vec)
+{
+  printf("%f %f %f %f\n", (*vec)[0], (*vec)[1], (*vec)[2], (*vec)[3]);
+}
+
+static inline void mat4f_print(const mat4f * mat)
+{
+  for (int i = 0; i < 4; i++)
+  {
+    printf("%f %f %f %f\n", mat->v0[i], mat->v1[i], mat->v2[i], mat->v3[i]);
+  }
+}
+
+#endif
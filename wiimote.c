@@ -9,6 +9,8 @@
 
 int tries = 0;
 
+int queue_interleave_ratio = 4;
+
 static uint8_t classic_calibration[16] =
 {
   // 0xF8, 0x04, 0x7A, 0xF8, 0x04, 0x7A, 0xF8, 0x04, 0x7A, 0xF8, 0x04, 0x7A, 0x00, 0x00, 0x00, 0x00
@@ -109,55 +111,10 @@ int process_report(struct wiimote_state *state, const uint8_t * buf, int len)
   return 0;
 }
 
-int generate_report(struct wiimote_state * state, uint8_t * buf)
+static int fill_report(struct wiimote_state * state, uint8_t * buf, int len)
 {
-  int len;
-
   struct report_data * data = (struct report_data *)buf;
-  uint8_t * contents;
-
-  if (state->usr.connected_extension_type != state->sys.connected_extension_type)
-  {
-    if (state->sys.extension_connected)
-    {
-      state->sys.extension_connected = 0;
-      state->sys.connected_extension_type = NoExtension;
-      state->sys.extension_hotplug_timer = 30;
-      report_queue_push_status(state);
-    }
-
-    bool extension_connected = (state->usr.connected_extension_type != NoExtension);
-    if (extension_connected && --state->sys.extension_hotplug_timer <= 0)
-    {
-      state->sys.extension_connected = extension_connected;
-      state->sys.connected_extension_type = state->usr.connected_extension_type;
-      report_queue_push_status(state);
-      init_extension(state);
-    }
-  }
-
-  if (!state->sys.reporting_continuous && !state->sys.report_changed && state->sys.queue == NULL)
-    return 0;
-
-  if (state->sys.queue == NULL)
-  {
-    //regular report
-    memset(data, 0, sizeof(struct report_data));
-    len = 2;
-    data->io = 0xa1;
-    data->type = state->sys.reporting_mode;
-  }
-  else
-  {
-    //queued report (acknowledgement, response, etc)
-    struct report * rpt;
-    rpt = report_queue_peek(state);
-    len = rpt->len;
-    memcpy(data, &rpt->data, sizeof(struct report_data));
-    report_queue_pop(state);
-  }
-
-  contents = data->buf;
+  uint8_t * contents = data->buf;
 
   //fill report
   switch (data->type)
@@ -223,6 +180,131 @@ int generate_report(struct wiimote_state * state, uint8_t * buf)
   return len;
 }
 
+static int fill_data_report(struct wiimote_state * state, uint8_t * buf, int * phase)
+{
+  struct report_data * data = (struct report_data *)buf;
+
+  memset(data, 0, sizeof(struct report_data));
+  data->io = 0xa1;
+  data->type = state->sys.reporting_mode;
+
+  //interleaved and motionplus passthrough reports alternate between two halves
+  *phase = (data->type == 0x3f) || state->sys.extension_report;
+
+  return fill_report(state, buf, 2);
+}
+
+static bool data_report_changed(struct wiimote_state * state, uint8_t * buf, int len, int phase)
+{
+  return (len != state->sys.last_report_len[phase]) ||
+    (memcmp(buf, state->sys.last_report[phase], len) != 0);
+}
+
+static int generate_data_report(struct wiimote_state * state, uint8_t * buf)
+{
+  int len;
+  int phase;
+  bool suppress;
+
+  //filling a report flips to the other half of a two part report
+  uint8_t reporting_mode = state->sys.reporting_mode;
+  bool extension_report = state->sys.extension_report;
+
+  len = fill_data_report(state, buf, &phase);
+
+  //only send when the contents changed, unless the wii asked for continuous reports
+  state->sys.report_changed = data_report_changed(state, buf, len, phase);
+  suppress = !state->sys.reporting_continuous || state->sys.drop_unchanged;
+
+  //an unchanged half must not hold back a change in the other half
+  if (!state->sys.report_changed && suppress &&
+      (state->sys.reporting_mode != reporting_mode ||
+       state->sys.extension_report != extension_report))
+  {
+    len = fill_data_report(state, buf, &phase);
+    state->sys.report_changed = data_report_changed(state, buf, len, phase);
+  }
+
+  if (!state->sys.report_changed && suppress)
+  {
+    //nothing was sent, so the next report starts from the same half
+    state->sys.reporting_mode = reporting_mode;
+    state->sys.extension_report = extension_report;
+    return 0;
+  }
+
+  memcpy(state->sys.last_report[phase], buf, len);
+  state->sys.last_report_len[phase] = len;
+
+  return len;
+}
+
+static int generate_queued_report(struct wiimote_state * state, uint8_t * buf)
+{
+  //queued report (acknowledgement, response, etc)
+  struct report * rpt;
+  int len;
+
+  rpt = report_queue_peek(state);
+  len = rpt->len;
+  memcpy(buf, &rpt->data, sizeof(struct report_data));
+  report_queue_pop(state);
+
+  return fill_report(state, buf, len);
+}
+
+int generate_report(struct wiimote_state * state, uint8_t * buf)
+{
+  int len;
+
+  if (state->usr.connected_extension_type != state->sys.connected_extension_type)
+  {
+    if (state->sys.extension_connected)
+    {
+      state->sys.extension_connected = 0;
+      state->sys.connected_extension_type = NoExtension;
+      state->sys.extension_hotplug_timer = 30;
+      report_queue_push_status(state);
+    }
+
+    bool extension_connected = (state->usr.connected_extension_type != NoExtension);
+    if (extension_connected && --state->sys.extension_hotplug_timer <= 0)
+    {
+      state->sys.extension_connected = extension_connected;
+      state->sys.connected_extension_type = state->usr.connected_extension_type;
+      report_queue_push_status(state);
+      init_extension(state);
+    }
+  }
+
+  //a data report gets a turn after every queue_interleave_ratio queued reports,
+  //so input stays live while e.g. a long memory read is answered
+  if (state->sys.queue != NULL && (queue_interleave_ratio <= 0 ||
+      state->sys.queued_since_data < queue_interleave_ratio))
+  {
+    state->sys.queued_since_data++;
+    state->sys.data_report = false;
+    state->sys.data_turn = false;
+    return generate_queued_report(state, buf);
+  }
+
+  state->sys.queued_since_data = 0;
+  state->sys.data_report = true;
+  state->sys.data_turn = true;
+  len = generate_data_report(state, buf);
+
+  //nothing new to report, keep the queue moving instead; a dropped data report
+  //leaves the interleave and passthrough phase where it was
+  if (len == 0 && state->sys.queue != NULL)
+  {
+    state->sys.queued_since_data++;
+    state->sys.data_report = false;
+    return generate_queued_report(state, buf);
+  }
+
+  return len;
+}
+
 void read_eeprom(struct wiimote_state * state, uint32_t offset, uint16_t size)
 {
   FILE * file;
@@ -264,21 +346,12 @@ void read_eeprom(struct wiimote_state * state, uint32_t offset, uint16_t size)
   //equivalent to ceil(size / 0x10)
   int total_packets = (size + 0x10 - 1) / 0x10;
 
-  //allocate all the needed reports
-  for (i = 0; i < total_packets; i++)
-  {
-    report_queue_push(state);
-  }
-
-  //copy packet data
-  struct queued_report * queue_item = state->sys.queue;
-
+  //queue one reply per packet, behind anything that is already queued
   for (i = 0; i < total_packets; i++)
   {
-    rpt = &queue_item->rpt;
+    rpt = report_queue_push(state);
     int packet_size = (i == total_packets - 1) ? (size - i * 0x10) : 0x10;
     report_format_mem_resp(state, rpt, packet_size, 0x0, offset + i*0x10, &buffer[i*0x10], false);
-    queue_item = queue_item->next;
   }
 
   free(buffer);
@@ -374,20 +447,12 @@ void read_register(struct wiimote_state *state, uint32_t offset, uint16_t size)
   //equivalent to ceil(size / 0x10)
   int total_packets = (size + 0x10 - 1) / 0x10;
 
-  //allocate all the needed reports
+  //queue one reply per packet, behind anything that is already queued
   for (i = 0; i < total_packets; i++)
   {
-    report_queue_push(state);
-  }
-
-  struct queued_report * queue_item = state->sys.queue;
-
-  for (i = 0; i < total_packets; i++)
-  {
-    rpt = &queue_item->rpt;
+    rpt = report_queue_push(state);
     int packet_size = (i == total_packets - 1) ? (size - i * 0x10) : 0x10;
     report_format_mem_resp(state, rpt, packet_size, 0x0, offset + i*0x10, &buffer[i*0x10], encrypt);
-    queue_item = queue_item->next;
   }
 }
 
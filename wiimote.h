@@ -140,6 +140,14 @@ struct wiimote_state_sys
   uint8_t reporting_mode;
   bool reporting_continuous;
   bool report_changed;
+  bool drop_unchanged; //also skip unchanged reports in continuous mode
+  bool data_report; //whether the last generated report was a data report
+  bool data_turn; //whether a data report had its turn, even if nothing changed
+  int queued_since_data;
+
+  //last regular report sent, one per phase of alternating report formats
+  uint8_t last_report[2][23];
+  uint8_t last_report_len[2];
 
   struct queued_report * queue;
   struct queued_report * queue_end;
@@ -156,6 +164,9 @@ struct wiimote_state
   struct wiimote_state_usr usr;
 };
 
+//queued reports sent between two data reports, 0 sends the whole queue first
+extern int queue_interleave_ratio;
+
 void wiimote_init(struct wiimote_state *state);
 void wiimote_destroy(struct wiimote_state *state);
 
@@ -1,7 +1,10 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/l2cap.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <poll.h>
 #include <pthread.h>
 #include <signal.h>
@@ -9,17 +12,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "adapter.h"
 #include "input.h"
+#include "input_evdev.h"
 #include "input_latency.h"
+#include "input_script.h"
 #include "input_sdl.h"
+#include "input_shm.h"
 #include "input_socket.h"
+#include "interp.h"
+#include "motion.h"
 #include "sdp.h"
+#include "session_log.h"
 #include "wiimote.h"
 #include "wm_print.h"
 
@@ -41,6 +53,66 @@ static uint64_t count_accel = 0;
 static uint64_t total_button_latency = 0;
 static uint64_t count_button = 0;
 
+// congestion control on the interrupt channel: instead of dropping the
+// connection as soon as the link stops accepting reports, the continuous
+// report rate is stepped down while the send buffer stays full
+static const uint64_t report_period_us[] = {0, 10000, 20000, 40000};
+static const int congestion_levels =
+    sizeof(report_period_us) / sizeof(report_period_us[0]);
+static const uint64_t nominal_report_period_us = 10000; // 100 Hz, as hardware
+static const int send_queue_high_watermark = 50;        // percent
+static const int send_queue_low_watermark = 25;         // percent
+static const uint64_t congestion_step_us = 100000;
+static const uint64_t congestion_clear_us = 500000;
+static const uint64_t link_stall_timeout_us = 3000000;
+
+static int congestion_level = 0;
+static int int_fd_sndbuf = 0;
+static uint64_t last_report_us = 0;
+static uint64_t last_level_change_us = 0;
+static uint64_t link_clear_since_us = 0;
+static uint64_t link_stalled_since_us = 0;
+static uint64_t skipped_frames = 0;
+static uint64_t rate_decreases = 0;
+static uint64_t rate_increases = 0;
+
+// late latch: input is only drained right before a report is due, so the
+// report carries the freshest sample instead of one up to a poll tick old
+static int late_latch = 0;
+// where -s records the session, NULL when it isn't recorded
+static char const *session_log_path = NULL;
+// options that change the reports, kept in a session log's header
+static struct session_log_options log_options;
+static const uint64_t input_age_idle_us = 1000000;
+static uint64_t total_input_age = 0;
+static uint64_t max_input_age = 0;
+static uint64_t count_input_age = 0;
+
+// reconnecting to a known host runs as a non-blocking state machine so that
+// input and the other sockets keep being serviced while the connects are
+// in flight or while waiting out the backoff
+enum reconnect_state {
+  RECONNECT_IDLE,
+  RECONNECT_CTRL,
+  RECONNECT_INT,
+  RECONNECT_BACKOFF,
+};
+
+static const uint64_t reconnect_backoff_min_us = 100000;
+static const uint64_t reconnect_backoff_max_us = 5000000;
+static const uint64_t reconnect_attempt_timeout_us = 5000000;
+
+static enum reconnect_state reconnect_state = RECONNECT_IDLE;
+static int pending_ctrl_fd = -1;
+static int pending_int_fd = -1;
+static uint64_t reconnect_backoff_us = 0;
+static uint64_t reconnect_at_us = 0;
+static uint64_t reconnect_attempt_us = 0;
+static uint64_t disconnected_at_us = 0;
+static uint64_t total_reconnect_time = 0;
+static uint64_t max_reconnect_time = 0;
+static uint64_t count_reconnect = 0;
+
 // signal handler to break out of main loop
 static int running = 1;
 void sig_handler(int sig) { running = 0; }
@@ -95,6 +167,46 @@ int l2cap_connect(bdaddr_t bdaddr, int psm) {
   return fd;
 }
 
+// Starts a connect without waiting for it; completion is signalled by POLLOUT
+// and the result can be read with socket_error.
+int l2cap_connect_nonblock(bdaddr_t bdaddr, int psm) {
+  int fd;
+  struct sockaddr_l2 addr;
+
+  fd = create_socket();
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.l2_family = AF_BLUETOOTH;
+  addr.l2_psm = htobs(psm);
+  addr.l2_bdaddr = bdaddr;
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+      errno != EINPROGRESS) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int socket_error(int fd) {
+  int err = 0;
+  socklen_t optlen = sizeof(err);
+
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &optlen) < 0) {
+    return errno;
+  }
+  return err;
+}
+
 int l2cap_listen(int psm) {
   int fd;
   struct sockaddr_l2 addr;
@@ -173,6 +285,8 @@ int connect_to_host() {
   int_fd = l2cap_connect(host_bdaddr, PSM_INT);
   if (int_fd < 0) {
     printf("can't connect to host psm %d: %s\n", PSM_INT, strerror(errno));
+    close(ctrl_fd);
+    ctrl_fd = 0;
     return -1;
   }
 
@@ -180,22 +294,227 @@ int connect_to_host() {
 }
 
 void disconnect() {
-  shutdown(sdp_fd, SHUT_RDWR);
-  shutdown(ctrl_fd, SHUT_RDWR);
-  shutdown(int_fd, SHUT_RDWR);
-
-  close(sdp_fd);
-  close(ctrl_fd);
-  close(int_fd);
+  if (sdp_fd > 0) {
+    shutdown(sdp_fd, SHUT_RDWR);
+    close(sdp_fd);
+  }
+  if (ctrl_fd > 0) {
+    shutdown(ctrl_fd, SHUT_RDWR);
+    close(ctrl_fd);
+  }
+  if (int_fd > 0) {
+    shutdown(int_fd, SHUT_RDWR);
+    close(int_fd);
+  }
 
   sdp_fd = 0;
   ctrl_fd = 0;
   int_fd = 0;
 }
 
+uint64_t monotonic_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * (uint64_t)1000000 + ts.tv_nsec / 1000;
+}
+
+// Returns how full the send buffer of fd is in percent, or -1 on error.
+// Bluetooth sockets answer SIOCOUTQ with the space still free in the send
+// buffer rather than the bytes queued, so it is compared against SO_SNDBUF.
+int send_queue_fill(int fd) {
+  int free_space;
+
+  if (int_fd_sndbuf <= 0) {
+    socklen_t optlen = sizeof(int_fd_sndbuf);
+    if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &int_fd_sndbuf, &optlen) < 0 ||
+        int_fd_sndbuf <= 0) {
+      int_fd_sndbuf = 0;
+      return -1;
+    }
+  }
+
+  if (ioctl(fd, SIOCOUTQ, &free_space) < 0) {
+    return -1;
+  }
+
+  if (free_space >= int_fd_sndbuf) {
+    return 0;
+  }
+  return (int_fd_sndbuf - free_space) * 100 / int_fd_sndbuf;
+}
+
+void reset_congestion() {
+  congestion_level = 0;
+  int_fd_sndbuf = 0;
+  last_report_us = 0;
+  last_level_change_us = 0;
+  link_clear_since_us = 0;
+  link_stalled_since_us = 0;
+}
+
+// Steps the report rate down while the link is congested and back up once it
+// has stayed clear for a while.
+void update_congestion(bool congested, bool clear, uint64_t now) {
+  if (congested) {
+    link_clear_since_us = 0;
+    if (congestion_level < congestion_levels - 1 &&
+        now - last_level_change_us >= congestion_step_us) {
+      congestion_level++;
+      rate_decreases++;
+      last_level_change_us = now;
+      printf("link congested, report period now %llu ms\n",
+             (unsigned long long)report_period_us[congestion_level] / 1000);
+    }
+  } else if (clear && congestion_level > 0) {
+    if (link_clear_since_us == 0) {
+      link_clear_since_us = now;
+    } else if (now - link_clear_since_us >= congestion_clear_us) {
+      congestion_level--;
+      rate_increases++;
+      last_level_change_us = now;
+      link_clear_since_us = now;
+      printf("link clear, report period now %llu ms\n",
+             (unsigned long long)report_period_us[congestion_level] / 1000);
+    }
+  }
+}
+
+// Queued reports (acks, status, memory reads) always go out as soon as the
+// link accepts them; only regular data reports are rate limited.
+uint64_t report_due_in(struct wiimote_state *state, uint64_t now) {
+  uint64_t period = report_period_us[congestion_level];
+
+  if (late_latch && period < nominal_report_period_us) {
+    period = nominal_report_period_us;
+  }
+
+  if (state->sys.queue != NULL || now - last_report_us >= period) {
+    return 0;
+  }
+  return period - (now - last_report_us);
+}
+
+void reconnect_abort() {
+  if (pending_ctrl_fd >= 0) {
+    close(pending_ctrl_fd);
+    pending_ctrl_fd = -1;
+  }
+  if (pending_int_fd >= 0) {
+    close(pending_int_fd);
+    pending_int_fd = -1;
+  }
+  reconnect_state = RECONNECT_IDLE;
+}
+
+// Waits out a random delay between half and all of the current backoff, which
+// doubles after every failed attempt.
+void reconnect_backoff(uint64_t now) {
+  reconnect_abort();
+
+  if (reconnect_backoff_us == 0) {
+    reconnect_backoff_us = reconnect_backoff_min_us;
+  } else if (reconnect_backoff_us < reconnect_backoff_max_us) {
+    reconnect_backoff_us *= 2;
+    if (reconnect_backoff_us > reconnect_backoff_max_us) {
+      reconnect_backoff_us = reconnect_backoff_max_us;
+    }
+  }
+
+  reconnect_at_us = now + reconnect_backoff_us / 2 +
+                    (uint64_t)rand() % (reconnect_backoff_us / 2 + 1);
+  reconnect_state = RECONNECT_BACKOFF;
+}
+
+// Advances the reconnect state machine. ctrl_revents and int_revents are the
+// poll results for the pending control and interrupt channel connects.
+// Returns 1 once both channels are connected.
+int reconnect_step(short ctrl_revents, short int_revents, uint64_t now) {
+  int err;
+
+  switch (reconnect_state) {
+  case RECONNECT_BACKOFF:
+    if (now < reconnect_at_us) {
+      return 0;
+    }
+    // fall through
+  case RECONNECT_IDLE:
+    pending_ctrl_fd = l2cap_connect_nonblock(host_bdaddr, PSM_CTRL);
+    if (pending_ctrl_fd < 0) {
+      reconnect_backoff(now);
+      return 0;
+    }
+    reconnect_attempt_us = now;
+    reconnect_state = RECONNECT_CTRL;
+    return 0;
+  case RECONNECT_CTRL:
+    if (!(ctrl_revents & (POLLOUT | POLLERR | POLLHUP))) {
+      break;
+    }
+    err = socket_error(pending_ctrl_fd);
+    if (err) {
+      reconnect_backoff(now);
+      return 0;
+    }
+    pending_int_fd = l2cap_connect_nonblock(host_bdaddr, PSM_INT);
+    if (pending_int_fd < 0) {
+      reconnect_backoff(now);
+      return 0;
+    }
+    reconnect_state = RECONNECT_INT;
+    return 0;
+  case RECONNECT_INT:
+    if (!(int_revents & (POLLOUT | POLLERR | POLLHUP))) {
+      break;
+    }
+    err = socket_error(pending_int_fd);
+    if (err) {
+      reconnect_backoff(now);
+      return 0;
+    }
+
+    ctrl_fd = pending_ctrl_fd;
+    int_fd = pending_int_fd;
+    pending_ctrl_fd = -1;
+    pending_int_fd = -1;
+    reconnect_state = RECONNECT_IDLE;
+    reconnect_backoff_us = 0;
+    return 1;
+  }
+
+  if (now - reconnect_attempt_us > reconnect_attempt_timeout_us) {
+    reconnect_backoff(now);
+  }
+  return 0;
+}
+
 void print_usage(char *argv0) {
-  printf("usage: %s [ <wii-bdaddr> [ gui | unix <path> | ip <port> ] ]\n",
-         argv0);
+  printf("usage: %s [-f <cutoff>,<beta>,<lead>[,<dcutoff>]] [-g] "
+         "[-i <limit>[,<delay>]] [-l] [-q <n>] [-r] [-s <log>] [-t] "
+         "[ <wii-bdaddr> [ gui | unix <path> | ip <port> | "
+         "stream <path> | tcp <port> | shm <name> | "
+         "evdev <device>[,<device>...] | script <file> [<loops> [<speed>]] "
+         "] ]\n"
+         "       %s [options] replay <log> [fast]\n"
+         "  -f <cutoff>,<beta>,<lead>[,<dcutoff>]\n"
+         "          filter the pointer (cutoff in Hz, beta per screen\n"
+         "          width/s) and predict it lead ms past each report, the\n"
+         "          speed is filtered at dcutoff Hz (default 1,10,0,5)\n"
+         "  -g      grab evdev devices, other programs don't see their input\n"
+         "  -i <limit>[,<delay>]\n"
+         "          interpolate sent accelerometer, nunchuk, MotionPlus and\n"
+         "          IR values delay ms in the past, extrapolating at most\n"
+         "          limit ms past the newest sample (default delay 0)\n"
+         "  -l      late latch: sample input just before each report is sent\n"
+         "  -q <n>  queued replies sent between two data reports (default %d,\n"
+         "          0 sends all queued replies first)\n"
+         "  -r      raw IR: IR objects only come from input packets, the\n"
+         "          pointer model is off\n"
+         "  -s <log>\n"
+         "          record input, reports from the Wii and sent reports to\n"
+         "          log, for replay with the same options\n"
+         "  -t      IR lookup table: interpolate the pointer model from a\n"
+         "          precomputed grid\n",
+         argv0, argv0, queue_interleave_ratio);
 }
 
 int main(int argc, char *argv[]) {
@@ -209,7 +528,74 @@ int main(int argc, char *argv[]) {
 
   int send_report_now = 1;
   int input_result;
-  int failure = 0;
+  uint64_t poll_timeout_us;
+  uint64_t now, due_in;
+  struct timespec poll_timeout;
+  int opt;
+  bool evdev_grab = false;
+
+  while ((opt = getopt(argc, argv, "f:gi:lq:rs:t")) != -1) {
+    switch (opt) {
+    case 'f': {
+      double min_cutoff = 1.0, beta = 10.0, lead_ms = 0.0;
+      double speed_cutoff = 5.0;
+      sscanf(optarg, "%lf,%lf,%lf,%lf", &min_cutoff, &beta, &lead_ms,
+             &speed_cutoff);
+      input_use_pointer_filter(min_cutoff, beta, speed_cutoff,
+                               lead_ms / 1000.0);
+      log_options.pointer_filter = 1;
+      log_options.filter[0] = min_cutoff;
+      log_options.filter[1] = beta;
+      log_options.filter[2] = lead_ms;
+      log_options.filter[3] = speed_cutoff;
+      break;
+    }
+    case 'g':
+      evdev_grab = true;
+      break;
+    case 'i': {
+      double limit_ms = 0.0, delay_ms = 0.0;
+      sscanf(optarg, "%lf,%lf", &limit_ms, &delay_ms);
+      input_use_interpolation(delay_ms / 1000.0, limit_ms / 1000.0);
+      log_options.interpolation = 1;
+      log_options.interp[0] = limit_ms;
+      log_options.interp[1] = delay_ms;
+      break;
+    }
+    case 'l':
+      late_latch = 1;
+      break;
+    case 'q':
+      queue_interleave_ratio = atoi(optarg);
+      break;
+    case 'r':
+      input_raw_ir = true;
+      log_options.raw_ir = 1;
+      break;
+    case 's':
+      session_log_path = optarg;
+      break;
+    case 't':
+      input_use_ir_table();
+      log_options.ir_table = 1;
+      break;
+    default:
+      print_usage(*argv);
+      return 1;
+    }
+  }
+
+  log_options.queue_interleave_ratio = queue_interleave_ratio;
+
+  // drop the options so the positional arguments start at argv[1]
+  argv[optind - 1] = argv[0];
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if (argc > 2 && strcmp(argv[1], "replay") == 0) {
+    bool fast = argc > 3 && strcmp(argv[3], "fast") == 0;
+    return session_replay(argv[2], fast, &log_options) == 0 ? 0 : 1;
+  }
 
   if (argc > 1) {
     if (strcmp(argv[1], "pair") == 0) {
@@ -231,11 +617,31 @@ int main(int argc, char *argv[]) {
   } else if (argc > 3 && strcmp(argv[2], "ip") == 0) {
     input_socket_init_ip_on_port(argv[3]);
     input_source = input_source_socket;
+  } else if (argc > 3 && strcmp(argv[2], "stream") == 0) {
+    input_socket_init_stream_unix_at_path(argv[3]);
+    input_source = input_source_socket_stream;
+  } else if (argc > 3 && strcmp(argv[2], "tcp") == 0) {
+    input_socket_init_stream_ip_on_port(argv[3]);
+    input_source = input_source_socket_stream;
+  } else if (argc > 3 && strcmp(argv[2], "evdev") == 0) {
+    input_evdev_init(argv[3], evdev_grab);
+    input_source = input_source_evdev;
+  } else if (argc > 3 && strcmp(argv[2], "shm") == 0) {
+    input_shm_init(argv[3]);
+    input_source = input_source_shm;
+  } else if (argc > 3 && strcmp(argv[2], "script") == 0) {
+    input_script_init(argv[3], argc > 4 ? atoi(argv[4]) : 1,
+                      argc > 5 ? atof(argv[5]) : 1.0);
+    input_source = input_source_script;
   } else {
     print_usage(*argv);
     return 1;
   }
 
+  if (session_log_path) {
+    session_log_open(session_log_path, &input_source, &log_options);
+  }
+
   // set up unload signals
   signal(SIGINT, sig_handler);
   signal(SIGTERM, sig_handler);
@@ -256,6 +662,9 @@ int main(int argc, char *argv[]) {
 
   wiimote_init(&state);
 
+  // reconnect backoff jitter
+  srand(time(NULL) ^ getpid());
+
   if (has_host) {
     printf("connecting to host...\n");
     if (connect_to_host() < 0) {
@@ -267,6 +676,7 @@ int main(int argc, char *argv[]) {
       printf("connected to %s\n", straddr);
 
       is_connected = 1;
+      reset_congestion();
     }
   } else {
     if (listen_for_connections() < 0) {
@@ -280,14 +690,18 @@ int main(int argc, char *argv[]) {
   while (running) {
     memset(&pfd, 0, sizeof(pfd));
 
-    pfd[0].fd = sock_sdp_fd;
-    pfd[1].fd = sock_ctrl_fd;
-    pfd[2].fd = sock_int_fd;
+    // sockets that aren't open yet are left out of the poll
+    pfd[0].fd = sock_sdp_fd > 0 ? sock_sdp_fd : -1;
+    pfd[1].fd = sock_ctrl_fd > 0 ? sock_ctrl_fd : -1;
+    pfd[2].fd = sock_int_fd > 0 ? sock_int_fd : -1;
 
-    pfd[3].fd = sdp_fd;
+    pfd[3].fd = sdp_fd > 0 ? sdp_fd : -1;
 
-    pfd[4].fd = ctrl_fd;
-    pfd[5].fd = int_fd;
+    pfd[4].fd = ctrl_fd > 0 ? ctrl_fd : -1;
+    pfd[5].fd = int_fd > 0 ? int_fd : -1;
+
+    poll_timeout_us = 20000;
+    now = monotonic_us();
 
     if (!is_connected) {
       pfd[0].events = POLLIN;
@@ -295,23 +709,43 @@ int main(int argc, char *argv[]) {
       pfd[2].events = POLLIN;
 
       pfd[3].events = POLLIN | POLLOUT;
+
+      if (reconnect_state == RECONNECT_CTRL) {
+        pfd[4].fd = pending_ctrl_fd;
+        pfd[4].events = POLLOUT;
+      } else if (reconnect_state == RECONNECT_INT) {
+        pfd[5].fd = pending_int_fd;
+        pfd[5].events = POLLOUT;
+      } else if (reconnect_state == RECONNECT_BACKOFF) {
+        due_in = reconnect_at_us > now ? reconnect_at_us - now : 0;
+        if (due_in < poll_timeout_us) {
+          poll_timeout_us = due_in;
+        }
+      }
     } else {
       pfd[4].events = POLLIN;
       pfd[5].events = POLLIN;
 
-      pfd[5].events |= POLLOUT;
+      due_in = report_due_in(&state, now);
+      if (send_report_now && due_in == 0) {
+        pfd[5].events |= POLLOUT;
+      } else if (send_report_now && due_in < poll_timeout_us) {
+        poll_timeout_us = due_in;
+      }
     }
 
-    if (poll(pfd, 6, 20) < 0) {
+    poll_timeout.tv_sec = 0;
+    poll_timeout.tv_nsec = poll_timeout_us * 1000;
+    if (ppoll(pfd, 6, &poll_timeout, NULL) < 0) {
       printf("poll error\n");
       break;
     }
 
-    if (pfd[4].revents & POLLERR) {
+    if (is_connected && (pfd[4].revents & POLLERR)) {
       printf("error on ctrl psm\n");
       break;
     }
-    if (pfd[5].revents & POLLERR) {
+    if (is_connected && (pfd[5].revents & POLLERR)) {
       printf("error on data psm\n");
       break;
     }
@@ -343,6 +777,12 @@ int main(int argc, char *argv[]) {
 
       is_connected = 1;
       has_host = 1;
+      reset_congestion();
+
+      // the host came back on its own
+      reconnect_abort();
+      reconnect_backoff_us = 0;
+      disconnected_at_us = 0;
     }
 
     if (pfd[3].revents & POLLIN) {
@@ -362,81 +802,166 @@ int main(int argc, char *argv[]) {
       len = recv(int_fd, buf, 32, MSG_DONTWAIT);
       if (len > 0) {
         print_report(buf, len);
+        session_log_host(buf, len);
         process_report(&state, buf, len);
       }
     }
 
-    input_result = input_update(&state, &input_source);
-    if (input_result) {
-      running = 0;
-      if (input_result == -2) {
-        power_off_host(&host_bdaddr);
-      } else {
-        disconnect(&host_bdaddr);
+    // with late latch, input waits until the report is about to be built
+    if (!late_latch || !is_connected || (pfd[5].events & POLLOUT)) {
+      session_log_update();
+      input_result = input_update(&state, &input_source);
+      if (input_result) {
+        running = 0;
+        if (input_result == -2) {
+          power_off_host(&host_bdaddr);
+        } else {
+          disconnect(&host_bdaddr);
+        }
       }
     }
 
-    if (is_connected && send_report_now) {
-      if (pfd[5].revents & POLLOUT) {
-        // Get the time right before (or after) sending the report:
-        struct timeval send_time;
-        gettimeofday(&send_time, NULL);
-
-        // If there is a pending IR event, compute latency:
-        if (pending_ir_ts.tv_sec != 0 || pending_ir_ts.tv_usec != 0) {
-          uint64_t latency =
-              (send_time.tv_sec - pending_ir_ts.tv_sec) * 1000000 +
-              (send_time.tv_usec - pending_ir_ts.tv_usec);
-          total_ir_latency += latency;
-          count_ir++;
-          // Clear the pending timestamp
-          pending_ir_ts.tv_sec = pending_ir_ts.tv_usec = 0;
+    if (is_connected && (pfd[5].events & POLLOUT)) {
+      int fill = send_queue_fill(int_fd);
+      bool writable = pfd[5].revents & POLLOUT;
+
+      now = monotonic_us();
+      update_congestion(!writable || fill > send_queue_high_watermark,
+                        writable && fill >= 0 &&
+                            fill < send_queue_low_watermark,
+                        now);
+
+      if (writable) {
+        link_stalled_since_us = 0;
+
+        // unchanged reports are dropped while the link is congested
+        state.sys.drop_unchanged = (congestion_level > 0);
+
+        session_log_build(state.sys.drop_unchanged);
+        input_prepare_report(&state);
+        len = generate_report(&state, buf);
+        session_log_report(buf, len);
+        bool regular = state.sys.data_report;
+        if (regular && len > 0) {
+          input_report_sent();
         }
-        // Similarly for accelerometer events:
-        if (pending_accel_ts.tv_sec != 0 || pending_accel_ts.tv_usec != 0) {
-          uint64_t latency =
-              (send_time.tv_sec - pending_accel_ts.tv_sec) * 1000000 +
-              (send_time.tv_usec - pending_accel_ts.tv_usec);
-          total_accel_latency += latency;
-          count_accel++;
-          pending_accel_ts.tv_sec = pending_accel_ts.tv_usec = 0;
+        if (state.sys.data_turn) {
+          input_report_turn();
         }
-        // And for button events:
-        if (pending_button_ts.tv_sec != 0 || pending_button_ts.tv_usec != 0) {
-          uint64_t latency =
-              (send_time.tv_sec - pending_button_ts.tv_sec) * 1000000 +
-              (send_time.tv_usec - pending_button_ts.tv_usec);
-          total_button_latency += latency;
-          count_button++;
-          pending_button_ts.tv_sec = pending_button_ts.tv_usec = 0;
+        if (regular && len == 0 && state.sys.reporting_continuous) {
+          skipped_frames++;
         }
 
-        len = generate_report(&state, buf);
         if (len > 0) {
+          // Get the time right before (or after) sending the report:
+          struct timeval send_time;
+          gettimeofday(&send_time, NULL);
+
+          // input on a script's own clock has no latency to measure
+          if (input_script_own_clock) {
+            pending_ir_ts.tv_sec = pending_ir_ts.tv_usec = 0;
+            pending_accel_ts.tv_sec = pending_accel_ts.tv_usec = 0;
+            pending_button_ts.tv_sec = pending_button_ts.tv_usec = 0;
+          }
+
+          // If there is a pending IR event, compute latency:
+          if (pending_ir_ts.tv_sec != 0 || pending_ir_ts.tv_usec != 0) {
+            uint64_t latency =
+                (send_time.tv_sec - pending_ir_ts.tv_sec) * 1000000 +
+                (send_time.tv_usec - pending_ir_ts.tv_usec);
+            total_ir_latency += latency;
+            count_ir++;
+            // Clear the pending timestamp
+            pending_ir_ts.tv_sec = pending_ir_ts.tv_usec = 0;
+          }
+          // Similarly for accelerometer events:
+          if (pending_accel_ts.tv_sec != 0 || pending_accel_ts.tv_usec != 0) {
+            uint64_t latency =
+                (send_time.tv_sec - pending_accel_ts.tv_sec) * 1000000 +
+                (send_time.tv_usec - pending_accel_ts.tv_usec);
+            total_accel_latency += latency;
+            count_accel++;
+            pending_accel_ts.tv_sec = pending_accel_ts.tv_usec = 0;
+          }
+          // And for button events:
+          if (pending_button_ts.tv_sec != 0 ||
+              pending_button_ts.tv_usec != 0) {
+            uint64_t latency =
+                (send_time.tv_sec - pending_button_ts.tv_sec) * 1000000 +
+                (send_time.tv_usec - pending_button_ts.tv_usec);
+            total_button_latency += latency;
+            count_button++;
+            pending_button_ts.tv_sec = pending_button_ts.tv_usec = 0;
+          }
+
+          // age of the newest input sample while input is flowing
+          if (regular && latest_input_ts.tv_sec != 0) {
+            uint64_t age =
+                (send_time.tv_sec - latest_input_ts.tv_sec) * 1000000 +
+                (send_time.tv_usec - latest_input_ts.tv_usec);
+            if (age < input_age_idle_us) {
+              total_input_age += age;
+              count_input_age++;
+              if (age > max_input_age) {
+                max_input_age = age;
+              }
+            }
+          }
+
           print_report(buf, len);
-          send(int_fd, buf, len, MSG_DONTWAIT);
+          if (send(int_fd, buf, len, MSG_DONTWAIT) < 0 &&
+              (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)) {
+            skipped_frames++;
+          }
         }
 
-        failure = 0;
+        if (regular) {
+          // frames a 100 Hz controller would have sent in the meantime
+          if (congestion_level > 0 && last_report_us != 0 &&
+              now - last_report_us > nominal_report_period_us) {
+            skipped_frames +=
+                (now - last_report_us) / nominal_report_period_us - 1;
+          }
+          last_report_us = now;
+        }
       } else {
-        if (++failure > 5) {
+        if (link_stalled_since_us == 0) {
+          link_stalled_since_us = now;
+        } else if (now - link_stalled_since_us > link_stall_timeout_us) {
           printf("connection timed out, attemping to reconnect...\n");
           disconnect();
           is_connected = 0;
+          disconnected_at_us = now;
         }
       }
     }
 
     if (has_host && !is_connected) {
-      if (connect_to_host() < 0) {
-        usleep(100 * 1000);
-      } else {
+      now = monotonic_us();
+      if (disconnected_at_us == 0) {
+        disconnected_at_us = now;
+      }
+
+      if (reconnect_step(pfd[4].revents, pfd[5].revents, now)) {
+        uint64_t reconnect_time = now - disconnected_at_us;
+        total_reconnect_time += reconnect_time;
+        count_reconnect++;
+        if (reconnect_time > max_reconnect_time) {
+          max_reconnect_time = reconnect_time;
+        }
+        disconnected_at_us = 0;
+
         printf("connected to host\n");
         is_connected = 1;
+        reset_congestion();
       }
     }
   }
 
+  // the writer thread has finished once the log is closed, so its byte
+  // count is final
+  session_log_close();
+
   printf("Latency statistics:\n");
   if (count_ir > 0)
     printf("  IR:         average %llu µs (%llu samples)\n",
@@ -448,8 +973,87 @@ int main(int argc, char *argv[]) {
     printf("  Button:     average %llu µs (%llu samples)\n",
            total_button_latency / count_button, count_button);
 
+  if (count_input_age > 0)
+    printf("  Input age:  average %llu µs, max %llu µs (%llu samples)\n",
+           (unsigned long long)(total_input_age / count_input_age),
+           (unsigned long long)max_input_age,
+           (unsigned long long)count_input_age);
+
+  if (input_coalesced_events > 0)
+    printf("  Coalesced:  %llu IR/accelerometer samples replaced before use\n",
+           (unsigned long long)input_coalesced_events);
+
+  if (input_filter_samples > 0)
+    printf("  Pointer filter: %llu samples, %.2f µs each, mean error %.4f "
+           "predicted, %.4f filtered only\n",
+           (unsigned long long)input_filter_samples,
+           input_filter_ns / 1000.0 / input_filter_samples,
+           input_prediction_error / input_filter_samples,
+           input_filtered_error / input_filter_samples);
+
+  if (interp_interpolated + interp_extrapolated + interp_held > 0)
+    printf("  Interpolation: %llu values between samples, %llu extrapolated, "
+           "%llu held at the limit\n",
+           (unsigned long long)interp_interpolated,
+           (unsigned long long)interp_extrapolated,
+           (unsigned long long)interp_held);
+
+  if (motion_skips > 0)
+    printf("  Motion:     %llu updates, %llu skipped with an unchanged "
+           "pointer (%.1f%%)\n",
+           (unsigned long long)motion_updates, (unsigned long long)motion_skips,
+           100.0 * motion_skips / (motion_updates + motion_skips));
+
+  if (session_log_bytes > 0)
+    printf("  Session log: %llu bytes written, %llu records dropped\n",
+           (unsigned long long)session_log_bytes,
+           (unsigned long long)session_log_dropped);
+
+  if (input_script_events > 0)
+    printf("  Script:     %llu events played, %llu passes completed\n",
+           (unsigned long long)input_script_events,
+           (unsigned long long)input_script_passes);
+
+  if (input_socket_events > 0)
+    printf("  Socket input: %llu events from %llu datagrams, %.2f syscalls "
+           "per event\n",
+           (unsigned long long)input_socket_events,
+           (unsigned long long)input_socket_datagrams,
+           (double)input_socket_syscalls / input_socket_events);
+  if (input_socket_stamped > 0)
+    printf("  Socket input: %llu events timed from capture, %llu clock "
+           "samples\n",
+           (unsigned long long)input_socket_stamped,
+           (unsigned long long)input_socket_pongs);
+  if (input_socket_lost + input_socket_reordered + input_socket_duplicates > 0)
+    printf("  Socket input: %llu lost, %llu late and %llu duplicate packets\n",
+           (unsigned long long)input_socket_lost,
+           (unsigned long long)input_socket_reordered,
+           (unsigned long long)input_socket_duplicates);
+  if (input_socket_refused > 0)
+    printf("  Socket input: %llu events refused, fields owned by another "
+           "client\n",
+           (unsigned long long)input_socket_refused);
+
+  if (input_shm_frames > 0)
+    printf("  Shared memory input: %llu frames\n",
+           (unsigned long long)input_shm_frames);
+
+  printf("Link statistics:\n");
+  printf("  Skipped frames: %llu\n", (unsigned long long)skipped_frames);
+  printf("  Rate changes:   %llu down, %llu up\n",
+         (unsigned long long)rate_decreases,
+         (unsigned long long)rate_increases);
+
+  if (count_reconnect > 0)
+    printf("  Reconnects: average %llu ms, max %llu ms (%llu reconnects)\n",
+           (unsigned long long)(total_reconnect_time / count_reconnect / 1000),
+           (unsigned long long)(max_reconnect_time / 1000),
+           (unsigned long long)count_reconnect);
+
   printf("cleaning up...\n");
 
+  reconnect_abort();
   disconnect();
 
   close(sock_sdp_fd);